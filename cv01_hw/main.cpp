@@ -1,19 +1,138 @@
 #include <iostream>
+#include <iomanip>
 #include <thread>
 #include <vector>
 #include <cmath>
 #include <chrono>
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+#include <immintrin.h>
+#endif /* __x86_64__ || __i386__ */
 
 using namespace std;
 
-void calcSum ( long from, long to, long & ret ) {
-    fprintf ( stderr, "I'm working here yo\n" );
-    long res = 0;
+/**
+ * The sum is made of blocks of BLOCK members, each summed in LANES Kahan lanes, member i going to the lane i % LANES.
+ * The lanes of a block and then the blocks are added up in a fixed order, so the result does not depend on the thread
+ * count nor on the instruction set. The kernels only differ in how many lanes they step at once, and they must not
+ * contract the expression into FMAs ( -ffp-contract=off ).
+ */
+static const long LANES = 8;
+static const long BLOCK = 1 << 14;
+
+struct TLanes {
+    double m_Sum[LANES] = {};
+    double m_Comp[LANES] = {};  // Kahan compensation
+};
+
+static inline double term ( double from ) {
+    return ( sqrt ( from + 1 ) + from ) / sqrt ( from * from + from + 1 );
+}
+
+static inline void kahanAdd ( double & sum, double & comp, double value ) {
+    double y = value - comp;
+    double t = sum + y;
+    comp = ( t - sum ) - y;
+    sum = t;
+}
+
+static void sumScalar ( long from, long to, TLanes & lanes ) {
     for ( ; from < to; from++ )
-        res += ( sqrt ( from + 1 ) + from )
-               /
-               sqrt ( pow ( from, 2 ) +  from + 1 );
-    ret = res;
+        kahanAdd ( lanes.m_Sum[from % LANES], lanes.m_Comp[from % LANES], term ( from ) );
+}
+
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+/**
+ * Steps the members in two vectors of four lanes, from must be a multiple of LANES.
+ * @return first member left to the scalar kernel
+ */
+__attribute__ (( target ( "avx2" ) ))
+static long sumAvx2 ( long from, long to, TLanes & lanes ) {
+    const __m256d one = _mm256_set1_pd ( 1 ), step = _mm256_set1_pd ( LANES );
+    __m256d f[2] = { _mm256_setr_pd ( 0, 1, 2, 3 ), _mm256_setr_pd ( 4, 5, 6, 7 ) };
+    __m256d sum[2], comp[2];
+    for ( int j = 0; j < 2; j++ ) {
+        f[j] = _mm256_add_pd ( f[j], _mm256_set1_pd ( from ) );
+        sum[j] = _mm256_loadu_pd ( lanes.m_Sum + 4 * j );
+        comp[j] = _mm256_loadu_pd ( lanes.m_Comp + 4 * j );
+    }
+    for ( ; from + LANES <= to; from += LANES )
+        for ( int j = 0; j < 2; j++ ) {
+            __m256d num = _mm256_add_pd ( _mm256_sqrt_pd ( _mm256_add_pd ( f[j], one ) ), f[j] );
+            __m256d den = _mm256_sqrt_pd ( _mm256_add_pd ( _mm256_add_pd ( _mm256_mul_pd ( f[j], f[j] ), f[j] ), one ) );
+            __m256d y = _mm256_sub_pd ( _mm256_div_pd ( num, den ), comp[j] );
+            __m256d t = _mm256_add_pd ( sum[j], y );
+            comp[j] = _mm256_sub_pd ( _mm256_sub_pd ( t, sum[j] ), y );
+            sum[j] = t;
+            f[j] = _mm256_add_pd ( f[j], step );
+        }
+    for ( int j = 0; j < 2; j++ ) {
+        _mm256_storeu_pd ( lanes.m_Sum + 4 * j, sum[j] );
+        _mm256_storeu_pd ( lanes.m_Comp + 4 * j, comp[j] );
+    }
+    return from;
+}
+
+/**
+ * Steps the members in a vector of all the lanes, from must be a multiple of LANES.
+ * @return first member left to the scalar kernel
+ */
+__attribute__ (( target ( "avx512f" ) ))
+static long sumAvx512 ( long from, long to, TLanes & lanes ) {
+    // _mm512_sqrt_pd passes an undefined vector through the unused mask lanes, a zeroed one keeps it defined
+    const __m512d zero = _mm512_setzero_pd (), one = _mm512_set1_pd ( 1 ), step = _mm512_set1_pd ( LANES );
+    const __mmask8 all = 0xFF;
+    __m512d f = _mm512_add_pd ( _mm512_setr_pd ( 0, 1, 2, 3, 4, 5, 6, 7 ), _mm512_set1_pd ( from ) );
+    __m512d sum = _mm512_loadu_pd ( lanes.m_Sum ), comp = _mm512_loadu_pd ( lanes.m_Comp );
+    for ( ; from + LANES <= to; from += LANES ) {
+        __m512d num = _mm512_add_pd ( _mm512_mask_sqrt_pd ( zero, all, _mm512_add_pd ( f, one ) ), f );
+        __m512d den = _mm512_mask_sqrt_pd ( zero, all, _mm512_add_pd ( _mm512_add_pd ( _mm512_mul_pd ( f, f ), f ), one ) );
+        __m512d y = _mm512_sub_pd ( _mm512_div_pd ( num, den ), comp );
+        __m512d t = _mm512_add_pd ( sum, y );
+        comp = _mm512_sub_pd ( _mm512_sub_pd ( t, sum ), y );
+        sum = t;
+        f = _mm512_add_pd ( f, step );
+    }
+    _mm512_storeu_pd ( lanes.m_Sum, sum );
+    _mm512_storeu_pd ( lanes.m_Comp, comp );
+    return from;
+}
+#endif /* __x86_64__ || __i386__ */
+
+using TKernel = long ( * ) ( long, long, TLanes & );
+
+static TKernel pickKernel () {
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+    if ( __builtin_cpu_supports ( "avx512f" ) )
+        return sumAvx512;
+    if ( __builtin_cpu_supports ( "avx2" ) )
+        return sumAvx2;
+#endif /* __x86_64__ || __i386__ */
+    return nullptr;
+}
+
+static const TKernel kernel = pickKernel ();
+
+/**
+ * Sums the members of the blocks [fromBlock, toBlock), members past count are left out.
+ * @param[out] ret sum of each block
+ */
+void calcSum ( long fromBlock, long toBlock, long count, double * ret ) {
+    fprintf ( stderr, "I'm working here yo\n" );
+    for ( long block = fromBlock; block < toBlock; block++ ) {
+        long from = block * BLOCK, to = min ( from + BLOCK, count );
+        TLanes lanes;
+        if ( kernel )
+            from = kernel ( from, to, lanes );
+        sumScalar ( from, to, lanes );
+        double lane[LANES];
+        for ( long i = 0; i < LANES; i++ )
+            lane[i] = lanes.m_Sum[i] - lanes.m_Comp[i];
+        // pairwise
+        for ( long width = LANES / 2; width > 0; width /= 2 )
+            for ( long i = 0; i < width; i++ )
+                lane[i] += lane[i + width];
+        ret[block - fromBlock] = lane[0];
+    }
 }
 
 
@@ -25,30 +144,35 @@ int main ( int argc, char * argv[] ) {
 
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    long sumMembers = stoi(argv[1]);
+    long sumMembers = stol(argv[1]);
     long threadCount = stoi(argv[2]);
+    if ( threadCount < 1 ) {
+        cout << "Expected ./main <m> <threadCount>" << endl;
+        return 1;
+    }
 
+    // the threads get whole blocks, so that the blocks are the same whatever the thread count
+    long blockCount = ( sumMembers + BLOCK - 1 ) / BLOCK;
     vector<thread> thr;
-    vector<long> results;
-    for ( int i = 0; i < threadCount; i ++ )
-        results.push_back ( 0 );
-    long cntPerThread = sumMembers/threadCount;
-
-    for ( int i = 0; i < threadCount; i ++ )
-        thr.emplace_back ( calcSum, i * cntPerThread, ( ( i + 1 ) * cntPerThread ) - 1, ref(results[i]) );
-    for ( int i = 0; i < threadCount; i ++ )
-        thr[i].join();
+    vector<double> results ( blockCount );
+    for ( long i = 0; i < threadCount; i ++ ) {
+        long from = i * blockCount / threadCount, to = ( i + 1 ) * blockCount / threadCount;
+        thr.emplace_back ( calcSum, from, to, sumMembers, results.data() + from );
+    }
+    for ( auto & t : thr )
+        t.join();
 
     // merge results
-    long long finalResult = 0;
+    double finalResult = 0, comp = 0;
     for ( const auto & res : results )
-        finalResult += res;
+        kahanAdd ( finalResult, comp, res );
+    finalResult -= comp;
 
     auto end_time = std::chrono::high_resolution_clock::now();
     auto elapsed_time = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time).count();
     std::cout << "Elapsed time: " << elapsed_time << " seconds" << std::endl;
 
-    cout << finalResult << " is the final result" << endl;
+    cout << setprecision ( 17 ) << finalResult << " is the final result" << endl;
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <thread>
+#include "bench_tester.h"
+using namespace std;
+
+//=============================================================================================================================================================
+                                       CCompanyBench::CCompanyBench            ( const TBenchConfig                  & config,
+                                                                                 size_t                                id )
+  : m_Config ( config ),
+    m_Rand ( config . m_Seed * 7919 + id ),
+    m_ReturnRand ( config . m_Seed * 7919 + id + 1 )
+{
+  uniform_int_distribution<size_t> packSize ( config . m_PackSizeMin, config . m_PackSizeMax );
+  geometric_distribution<size_t> packSizeGeo ( 1.0 / ( 1.0 + ( config . m_PackSizeMin + config . m_PackSizeMax ) / 2.0 ) );
+  uniform_int_distribution<int> intervals ( config . m_IntervalsMin, config . m_IntervalsMax );
+  uniform_int_distribution<int> count ( config . m_CountMin, config . m_CountMax );
+  uniform_int_distribution<int> from ( 0, 1000 ), length ( 20, 130 ), payment ( 1, 100 );
+
+  m_Packs . reserve ( config . m_Packs );
+  for ( size_t i = 0; i < config . m_Packs; i ++ )
+  {
+    AProblemPack pack = make_shared<CProblemPack> ();
+    size_t size = config . m_PackSizeGeometric ? max ( config . m_PackSizeMin, packSizeGeo ( m_Rand ) ) : packSize ( m_Rand );
+    for ( size_t j = 0; j < size; j ++ )
+    {
+      AProblem problem = make_shared<CProblem> ( count ( m_Rand ), initializer_list<CInterval> {} );
+      for ( int k = intervals ( m_Rand ); k > 0; k -- )
+      {
+        int start = from ( m_Rand );
+        problem -> add ( CInterval ( start, start + length ( m_Rand ), payment ( m_Rand ) ) );
+      }
+      pack -> add ( problem );
+      // computed before the run, so that the check does not slow it down
+      bool check = config . m_Reference && config . m_CheckEvery && m_Expected . size () % config . m_CheckEvery == 0;
+      m_Expected . push_back ( check ? config . m_Reference ( *problem ) : INT_MIN );
+    }
+    m_Packs . push_back ( pack );
+  }
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyBench::delay                    ( mt19937                             & rand,
+                                                                                 chrono::microseconds                  mean )
+{
+  if ( mean . count () == 0 )
+    return;
+  exponential_distribution<double> wait ( 1.0 / mean . count () );
+  this_thread::sleep_for ( chrono::microseconds ( (long long) wait ( rand ) ) );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+AProblemPack                           CCompanyBench::waitForPack              ( void )
+{
+  if ( m_GetPos == m_Packs . size () )
+    return AProblemPack ();
+  if ( m_GetPos > m_Packs . size () )
+    throw invalid_argument ( "waitForPack: called too many times" );
+  delay ( m_Rand, m_Config . m_ArrivalDelay );
+  unique_lock<mutex> lk ( m_Mtx );
+  m_Sent . push_back ( chrono::steady_clock::now () );
+  return m_Packs[m_GetPos ++];
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyBench::solvedPack               ( AProblemPack                          pack )
+{
+  auto now = chrono::steady_clock::now ();
+  if ( m_DonePos >= m_Packs . size () )
+    throw invalid_argument ( "solvedPack: called too many times" );
+  if ( m_Packs[m_DonePos ++] != pack )
+    throw invalid_argument ( "solvedPack: order not preserved" );
+  for ( const auto & problem : pack -> m_Problems )
+  {
+    int expected = m_Expected[m_DoneProblems ++];
+    if ( expected != INT_MIN && problem -> m_MaxProfit != expected )
+      throw invalid_argument ( "solvedPack: invalid result" );
+  }
+  {
+    unique_lock<mutex> lk ( m_Mtx );
+    m_Turnarounds . push_back ( chrono::duration_cast<chrono::nanoseconds> ( now - m_Sent . front () ) . count () );
+    m_Sent . pop_front ();
+  }
+  delay ( m_ReturnRand, m_Config . m_ReturnDelay );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   CCompanyBench::allProcessed             ( void ) const
+{
+  return m_GetPos == m_Packs . size () && m_DonePos == m_Packs . size ();
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+size_t                                 CCompanyBench::problemCount             ( void ) const
+{
+  size_t res = 0;
+  for ( const auto & pack : m_Packs )
+    res += pack -> m_Problems . size ();
+  return res;
+}
+//=============================================================================================================================================================
@@ -0,0 +1,99 @@
+// Load generator for benchmarking the optimizer. Like the sample tester, it does not exist
+// in the progtest's testing environment.
+#ifndef BENCH_TESTER_H_7361492850173645
+#define BENCH_TESTER_H_7361492850173645
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "common.h"
+
+//=============================================================================================================================================================
+/**
+ * Shape of the load one company produces. Ranges are inclusive, delays are means of exponentially distributed waits.
+ */
+struct TBenchConfig
+{
+  size_t                               m_Packs             { 1000 };
+  size_t                               m_PackSizeMin       { 1 };
+  size_t                               m_PackSizeMax       { 4 };
+  bool                                 m_PackSizeGeometric { false };   // geometric distribution with mean ( min + max ) / 2 instead of uniform
+  int                                  m_IntervalsMin      { 5 };
+  int                                  m_IntervalsMax      { 10 };
+  int                                  m_CountMin          { 1 };
+  int                                  m_CountMax          { 3 };
+  std::chrono::microseconds            m_ArrivalDelay      { 0 };       // before waitForPack returns
+  std::chrono::microseconds            m_ReturnDelay       { 0 };       // inside solvedPack
+  uint32_t                             m_Seed              { 1 };
+  std::function<int ( const CProblem & )> m_Reference;                    // computes the expected result, none = results not checked
+  size_t                               m_CheckEvery        { 16 };      // every n-th problem is checked against m_Reference
+};
+//=============================================================================================================================================================
+/**
+ * A company the benchmark can check and measure.
+ */
+class CCompanyMeasured : public CCompany
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual bool                       allProcessed                            ( void ) const = 0;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual size_t                     problemCount                            ( void ) const = 0;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @return turnaround of each returned pack in ns, in the order of return
+     */
+    const std::vector<uint64_t>      & turnarounds                             ( void ) const { return m_Turnarounds; }
+  protected:
+    std::vector<uint64_t>              m_Turnarounds;
+};
+using ACompanyMeasured = std::shared_ptr<CCompanyMeasured>;
+//=============================================================================================================================================================
+/**
+ * A company delivering randomly generated problems. All problems are generated in the constructor, so the generation
+ * does not slow down the measured run. The turnaround of each pack (waitForPack returned -> solvedPack called)
+ * is recorded.
+ */
+class CCompanyBench : public CCompanyMeasured
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @param[in] config      load shape
+     * @param[in] id          company index, mixed into the random seed
+     */
+                                       CCompanyBench                           ( const TBenchConfig                  & config,
+                                                                                 size_t                                id );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual AProblemPack               waitForPack                             ( void ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Checks the order of the returned packs and the results of the sampled problems, records their turnaround.
+     */
+    virtual void                       solvedPack                              ( AProblemPack                          pack ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual bool                       allProcessed                            ( void ) const override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual size_t                     problemCount                            ( void ) const override;
+  private:
+    TBenchConfig                       m_Config;
+    std::mt19937                       m_Rand;                                  // generation and arrival delays
+    std::mt19937                       m_ReturnRand;                            // return delays, used by the other thread
+    std::vector<AProblemPack>          m_Packs;
+    size_t                             m_GetPos  { 0 };
+    size_t                             m_DonePos { 0 };
+    std::vector<int>                   m_Expected;                              // by problem in the order of delivery, INT_MIN = not checked
+    size_t                             m_DoneProblems { 0 };
+    std::mutex                         m_Mtx;                                   // m_Sent is shared by waitForPack and solvedPack
+    std::deque<std::chrono::steady_clock::time_point> m_Sent;
+
+    static void                        delay                                   ( std::mt19937                        & rand,
+                                                                                 std::chrono::microseconds             mean );
+};
+using ACompanyBench = std::shared_ptr<CCompanyBench>;
+//=============================================================================================================================================================
+#endif /* BENCH_TESTER_H_7361492850173645 */
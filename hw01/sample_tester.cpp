@@ -62,17 +62,23 @@ std::initializer_list<AProblem> g_Problems =
 };
 std::vector<int> g_Results { 278, 231, 413, 580, 293, 206, 251, 323, 235, 519, 257, 203, 284, 255, 417, 250, 247, 355, 205, 407, 352, 306, 242, 341, 541, 447, 278, 293, 432, 170, 131, 239, 293, 288, 413, 301, 235, 274, 320, 422, 504, 153, 225, 496, 232, 284, 312, 328, 300, 358};
 //=============================================================================================================================================================
+                                       CCompanyTest::CCompanyTest              ( void )
+{
+  for ( const auto & problem : g_Problems )
+    m_Problems . push_back ( std::make_shared<CProblem> ( *problem ) );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
 AProblemPack                           CCompanyTest::waitForPack               ( void )
 {
   size_t idx = m_GetPos;
-  if ( idx == g_Problems . size () )
+  if ( idx == m_Problems . size () )
     return AProblemPack ();
-  if ( idx > g_Problems . size () )
+  if ( idx > m_Problems . size () )
     throw std::invalid_argument ( "waitForPack: called too many times" );
   AProblemPack res = std::make_shared<CProblemPack> ();
-  size_t cnt = std::min<size_t> ( rand () % 4 + 1, g_Problems . size () - m_GetPos );
+  size_t cnt = std::min<size_t> ( rand () % 4 + 1, m_Problems . size () - m_GetPos );
   while ( cnt -- )
-    res -> add ( g_Problems . begin () [m_GetPos ++] );
+    res -> add ( m_Problems [m_GetPos ++] );
   return res;
 }
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -82,10 +88,10 @@ void                                   CCompanyTest::solvedPack                (
   {
     size_t idx = m_DonePos ++;
   
-    if ( idx >= g_Problems . size () )
+    if ( idx >= m_Problems . size () )
       throw std::invalid_argument ( "solvedPack: called too many times" );
     
-    if ( g_Problems . begin () [idx] != problem )
+    if ( m_Problems [idx] != problem )
       throw std::invalid_argument ( "solvedPack: order not preserved" );
 
     if ( problem -> m_MaxProfit != g_Results[idx] )
@@ -95,6 +101,25 @@ void                                   CCompanyTest::solvedPack                (
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 bool                                   CCompanyTest::allProcessed              ( void ) const
 {
-  return m_GetPos == g_Problems . size () && m_DonePos == g_Problems . size ();
+  return m_GetPos == m_Problems . size () && m_DonePos == m_Problems . size ();
+}
+//=============================================================================================================================================================
+AProblemPack                           CCompanyIdle::waitForPack               ( void )
+{
+  std::unique_lock<std::mutex> lock ( m_Mtx );
+  m_CVReleased . wait ( lock, [ this ] { return m_Released; } );
+  return AProblemPack ();
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyIdle::solvedPack                ( AProblemPack                          )
+{
+  throw std::invalid_argument ( "solvedPack: the idle company delivered no pack" );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyIdle::release                   ( void )
+{
+  std::lock_guard<std::mutex> lock ( m_Mtx );
+  m_Released = true;
+  m_CVReleased . notify_all ();
 }
 //=============================================================================================================================================================
@@ -4,6 +4,8 @@
 #ifndef SAMPLE_TESTER_H_2983745628345129345
 #define SAMPLE_TESTER_H_2983745628345129345
 
+#include <condition_variable>
+#include <mutex>
 #include "common.h"
 
 //=============================================================================================================================================================
@@ -15,6 +17,13 @@ class CCompanyTest : public CCompany
 {
   public:
     //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Each company delivers its own copies of the sample problems. Shared instances would be written
+     * by the solvers of several companies at once, and a problem left unsolved by the solver of one
+     * company would pass the check with the result filled in for another one.
+     */
+                                       CCompanyTest                            ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
     /**
      * A basic implementation of the waitForPack method from the base class.
      *
@@ -37,9 +46,41 @@ class CCompanyTest : public CCompany
      */
     bool                               allProcessed                            ( void ) const;
   private:
+    std::vector<AProblem>              m_Problems;
     size_t                             m_GetPos  { 0 };
     size_t                             m_DonePos { 0 };
 };
 using ACompanyTest = std::shared_ptr<CCompanyTest>;
 //=============================================================================================================================================================
+/**
+ * A company that stays connected without delivering any pack. Its waitForPack blocks until release() is called,
+ * so an optimizer in the service mode never sees all of its receivers idle meanwhile.
+ */
+class CCompanyIdle : public CCompany
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Blocks until release() is called.
+     *
+     * @return an empty smart pointer
+     */
+    virtual AProblemPack               waitForPack                             ( void ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Never called, the company delivers no pack.
+     */
+    virtual void                       solvedPack                              ( AProblemPack                          pack ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Lets waitForPack return the end of input.
+     */
+    void                               release                                 ( void );
+  private:
+    std::mutex                         m_Mtx;
+    std::condition_variable            m_CVReleased;
+    bool                               m_Released { false };
+};
+using ACompanyIdle = std::shared_ptr<CCompanyIdle>;
+//=============================================================================================================================================================
 #endif /* SAMPLE_TESTER_H_2983745628345129345 */
@@ -0,0 +1,354 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shard_tester.h"
+using namespace std;
+
+/**
+ * Record layout, all numbers in the native byte order, each record is preceded by its uint32_t length:
+ *   pack     uint32_t problems, for each: int32_t count, uint32_t intervals, for each: int32_t from, to, payment
+ *   end      empty record, no more packs
+ *   result   int32_t max profit of each problem of the pack
+ */
+template <typename T>
+static void                            append                                  ( vector<char>                        & buffer,
+                                                                                 T                                     value )
+{
+  buffer . insert ( buffer . end (), (const char *) &value, (const char *) &value + sizeof ( value ) );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+template <typename T>
+static T                               take                                    ( const char                         *& pos )
+{
+  T res;
+  memcpy ( &res, pos, sizeof ( T ) );
+  pos += sizeof ( T );
+  return res;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+static void                            seal                                    ( vector<char>                        & buffer )
+{
+  uint32_t length = buffer . size () - sizeof ( uint32_t );
+  memcpy ( buffer . data (), &length, sizeof ( length ) );
+}
+//=============================================================================================================================================================
+void                                   CShmPipe::init                          ( void )
+{
+  pthread_mutexattr_t mtxAttr;
+  pthread_mutexattr_init ( &mtxAttr );
+  pthread_mutexattr_setpshared ( &mtxAttr, PTHREAD_PROCESS_SHARED );
+  pthread_mutexattr_setrobust ( &mtxAttr, PTHREAD_MUTEX_ROBUST );
+  pthread_mutex_init ( &m_Mtx, &mtxAttr );
+  pthread_mutexattr_destroy ( &mtxAttr );
+  pthread_condattr_t condAttr;
+  pthread_condattr_init ( &condAttr );
+  pthread_condattr_setpshared ( &condAttr, PTHREAD_PROCESS_SHARED );
+  pthread_cond_init ( &m_Readable, &condAttr );
+  pthread_cond_init ( &m_Writable, &condAttr );
+  pthread_condattr_destroy ( &condAttr );
+  m_Head = m_Tail = 0;
+  m_Closed = false;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShmPipe::recover                       ( int                                   res )
+{
+  if ( res != EOWNERDEAD )
+    return;
+  // the peer died holding the mutex, the stream may be torn
+  pthread_mutex_consistent ( &m_Mtx );
+  m_Closed = true;
+  pthread_cond_broadcast ( &m_Readable );
+  pthread_cond_broadcast ( &m_Writable );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShmPipe::lock                          ( void )
+{
+  recover ( pthread_mutex_lock ( &m_Mtx ) );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShmPipe::wait                          ( pthread_cond_t                      & cond )
+{
+  recover ( pthread_cond_wait ( &cond, &m_Mtx ) );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   CShmPipe::write                         ( const void                          * data,
+                                                                                 size_t                                size )
+{
+  const char * src = (const char *) data;
+  lock ();
+  while ( size > 0 )
+  {
+    while ( ! m_Closed && m_Tail - m_Head == CAPACITY )
+      wait ( m_Writable );
+    if ( m_Closed )
+      break;
+    size_t chunk = min ( size, CAPACITY - ( m_Tail - m_Head ) );
+    size_t pos = m_Tail % CAPACITY, first = min ( chunk, CAPACITY - pos );
+    memcpy ( m_Data + pos, src, first );
+    memcpy ( m_Data, src + first, chunk - first );
+    m_Tail += chunk;
+    src += chunk;
+    size -= chunk;
+    pthread_cond_signal ( &m_Readable );
+  }
+  pthread_mutex_unlock ( &m_Mtx );
+  return size == 0;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   CShmPipe::read                          ( void                                * data,
+                                                                                 size_t                                size )
+{
+  char * dst = (char *) data;
+  lock ();
+  while ( size > 0 )
+  {
+    while ( ! m_Closed && m_Tail == m_Head )
+      wait ( m_Readable );
+    if ( m_Tail == m_Head )
+      break;
+    size_t chunk = min ( size, size_t ( m_Tail - m_Head ) );
+    size_t pos = m_Head % CAPACITY, first = min ( chunk, CAPACITY - pos );
+    memcpy ( dst, m_Data + pos, first );
+    memcpy ( dst + first, m_Data, chunk - first );
+    m_Head += chunk;
+    dst += chunk;
+    size -= chunk;
+    pthread_cond_signal ( &m_Writable );
+  }
+  pthread_mutex_unlock ( &m_Mtx );
+  return size == 0;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShmPipe::close                         ( void )
+{
+  lock ();
+  m_Closed = true;
+  pthread_cond_broadcast ( &m_Readable );
+  pthread_cond_broadcast ( &m_Writable );
+  pthread_mutex_unlock ( &m_Mtx );
+}
+//=============================================================================================================================================================
+                                       CShardFront::CShardFront                ( ACompany                              company,
+                                                                                 CShmPipe                            & packs,
+                                                                                 CShmPipe                            & results )
+  : m_Company ( move ( company ) ),
+    m_Packs ( packs ),
+    m_Results ( results )
+{
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShardFront::start                      ( void )
+{
+  m_Feeder = thread ( &CShardFront::feed, this );
+  m_Collector = thread ( &CShardFront::collect, this );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   CShardFront::join                       ( void )
+{
+  m_Feeder . join ();
+  m_Collector . join ();
+  return ! m_Failed && m_Pending . empty ();
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShardFront::feed                       ( void )
+{
+  vector<char> buffer;
+  while ( true )
+  {
+    AProblemPack pack = m_Company -> waitForPack ();
+    buffer . assign ( sizeof ( uint32_t ), 0 );
+    if ( pack )
+    {
+      append<uint32_t> ( buffer, pack -> m_Problems . size () );
+      for ( const auto & problem : pack -> m_Problems )
+      {
+        append<int32_t> ( buffer, problem -> m_Count );
+        append<uint32_t> ( buffer, problem -> m_Intervals . size () );
+        for ( const auto & interval : problem -> m_Intervals )
+          for ( int32_t field : { interval . m_From, interval . m_To, interval . m_Payment } )
+            append<int32_t> ( buffer, field );
+      }
+      // before the write, the result may come back right after it
+      unique_lock<mutex> lk ( m_Mtx );
+      m_Pending . push_back ( pack );
+    }
+    seal ( buffer );
+    if ( ! m_Packs . write ( buffer . data (), buffer . size () ) || ! pack )
+      return;
+  }
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CShardFront::collect                    ( void )
+{
+  vector<int32_t> profits;
+  uint32_t length;
+  while ( m_Results . read ( &length, sizeof ( length ) ) )
+  {
+    profits . resize ( length / sizeof ( int32_t ) );
+    if ( ! m_Results . read ( profits . data (), length ) )
+      break;
+    AProblemPack pack;
+    {
+      unique_lock<mutex> lk ( m_Mtx );
+      if ( ! m_Pending . empty () )
+      {
+        pack = m_Pending . front ();
+        m_Pending . pop_front ();
+      }
+    }
+    if ( ! pack || pack -> m_Problems . size () != profits . size () )
+    {
+      // the shard lost track, stop it and the feeder instead of returning wrong results
+      m_Failed = true;
+      m_Packs . close ();
+      m_Results . close ();
+      return;
+    }
+    for ( size_t i = 0; i < profits . size (); i ++ )
+      pack -> m_Problems[i] -> m_MaxProfit = profits[i];
+    m_Company -> solvedPack ( pack );
+  }
+}
+//=============================================================================================================================================================
+                                       CCompanyShard::CCompanyShard            ( CShmPipe                            & packs,
+                                                                                 CShmPipe                            & results )
+  : m_Packs ( packs ),
+    m_Results ( results )
+{
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+AProblemPack                           CCompanyShard::waitForPack              ( void )
+{
+  uint32_t length;
+  if ( ! m_Packs . read ( &length, sizeof ( length ) ) || length == 0 )
+    return AProblemPack ();
+  m_Buffer . resize ( length );
+  if ( ! m_Packs . read ( m_Buffer . data (), length ) )
+    return AProblemPack ();
+
+  const char * pos = m_Buffer . data ();
+  AProblemPack pack = make_shared<CProblemPack> ();
+  for ( uint32_t problems = take<uint32_t> ( pos ); problems > 0; problems -- )
+  {
+    int32_t count = take<int32_t> ( pos );
+    AProblem problem = make_shared<CProblem> ( count, initializer_list<CInterval> {} );
+    uint32_t intervals = take<uint32_t> ( pos );
+    problem -> m_Intervals . reserve ( intervals );
+    for ( ; intervals > 0; intervals -- )
+    {
+      int32_t from = take<int32_t> ( pos ), to = take<int32_t> ( pos ), payment = take<int32_t> ( pos );
+      problem -> add ( CInterval ( from, to, payment ) );
+    }
+    pack -> add ( problem );
+  }
+  return pack;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyShard::solvedPack               ( AProblemPack                          pack )
+{
+  vector<char> buffer ( sizeof ( uint32_t ) );
+  for ( const auto & problem : pack -> m_Problems )
+    append<int32_t> ( buffer, problem -> m_MaxProfit );
+  seal ( buffer );
+  m_Results . write ( buffer . data (), buffer . size () );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyShard::finish                   ( void )
+{
+  m_Packs . close ();
+  m_Results . close ();
+}
+//=============================================================================================================================================================
+namespace
+{
+  struct TShardHeader
+  {
+    atomic<int64_t>                    m_Budget;
+  };
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   runSharded                              ( const vector<ACompany>              & companies,
+                                                                                 size_t                                shards,
+                                                                                 int64_t                               budget,
+                                                                                 const function<void ( size_t,
+                                                                                                       const vector<ACompany> &,
+                                                                                                       atomic<int64_t> * )> & worker )
+{
+  static_assert ( atomic<int64_t>::is_always_lock_free, "the budget is updated by several processes" );
+  size_t n = companies . size ();
+  // pipes[2 * i] carries the packs of company i, pipes[2 * i + 1] their results
+  size_t offset = ( sizeof ( TShardHeader ) + alignof ( CShmPipe ) - 1 ) / alignof ( CShmPipe ) * alignof ( CShmPipe );
+  size_t size = offset + 2 * n * sizeof ( CShmPipe );
+  void * region = mmap ( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if ( region == MAP_FAILED )
+    throw runtime_error ( "runSharded: cannot map the shared memory" );
+  TShardHeader * header = new ( region ) TShardHeader;
+  header -> m_Budget . store ( budget );
+  CShmPipe * pipes = (CShmPipe *) ( (char *) region + offset );
+  for ( size_t i = 0; i < 2 * n; i ++ )
+    pipes[i] . init ();
+
+  // the children would flush the buffered output once more
+  fflush ( nullptr );
+  vector<pid_t> children;
+  for ( size_t k = 0; k < shards; k ++ )
+  {
+    pid_t pid = fork ();
+    if ( pid == 0 )
+    {
+      vector<ACompanyShard> shard;
+      vector<ACompany> own;
+      for ( size_t i = k; i < n; i += shards )
+      {
+        shard . push_back ( make_shared<CCompanyShard> ( pipes[2 * i], pipes[2 * i + 1] ) );
+        own . push_back ( shard . back () );
+      }
+      int status = 0;
+      try
+      {
+        worker ( k, own, budget < 0 ? nullptr : &header -> m_Budget );
+      }
+      catch ( const exception & e )
+      {
+        fprintf ( stderr, "shard %zu: %s\n", k, e . what () );
+        status = 1;
+      }
+      for ( const auto & company : shard )
+        company -> finish ();
+      fflush ( nullptr );
+      _exit ( status );
+    }
+    children . push_back ( pid );
+  }
+
+  vector<unique_ptr<CShardFront>> fronts;
+  for ( size_t i = 0; i < n; i ++ )
+  {
+    fronts . push_back ( make_unique<CShardFront> ( companies[i], pipes[2 * i], pipes[2 * i + 1] ) );
+    fronts . back () -> start ();
+  }
+  bool ok = true;
+  for ( size_t k = 0; k < shards; k ++ )
+  {
+    int status;
+    if ( children[k] < 0 || waitpid ( children[k], &status, 0 ) < 0 || ! WIFEXITED ( status ) || WEXITSTATUS ( status ) != 0 )
+      ok = false;
+    // a shard that did not get to the end of its companies leaves their fronts waiting
+    for ( size_t i = k; i < n; i += shards )
+    {
+      pipes[2 * i] . close ();
+      pipes[2 * i + 1] . close ();
+    }
+  }
+  for ( auto & front : fronts )
+    ok = front -> join () && ok;
+  munmap ( region, size );
+  return ok;
+}
+//=============================================================================================================================================================
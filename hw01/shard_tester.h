@@ -0,0 +1,137 @@
+// Running the optimizer sharded across several processes that exchange the packs through shared memory. Like the sample
+// tester, it does not exist in the progtest's testing environment.
+#ifndef SHARD_TESTER_H_3091827465019283
+#define SHARD_TESTER_H_3091827465019283
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include "common.h"
+
+//=============================================================================================================================================================
+/**
+ * One way byte stream between two processes. It lives in a shared mapping and is set up in place by init() before
+ * the fork. The mutex is robust, a peer dying while it holds it closes the pipe instead of blocking the other one.
+ */
+class CShmPipe
+{
+  public:
+    static const size_t                CAPACITY                                = 1 << 18;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               init                                    ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Blocks while the pipe is full.
+     * @return false if the pipe got closed, the rest of the data is dropped
+     */
+    bool                               write                                   ( const void                          * data,
+                                                                                 size_t                                size );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Blocks until size bytes arrive. The data written before the pipe got closed can still be read.
+     * @return false if the pipe got closed before size bytes arrived
+     */
+    bool                               read                                    ( void                                * data,
+                                                                                 size_t                                size );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               close                                   ( void );
+  private:
+    pthread_mutex_t                    m_Mtx;
+    pthread_cond_t                     m_Readable;
+    pthread_cond_t                     m_Writable;
+    uint64_t                           m_Head;                                  // bytes read so far
+    uint64_t                           m_Tail;                                  // bytes written so far
+    bool                               m_Closed;
+    char                               m_Data[CAPACITY];
+
+    void                               lock                                    ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               wait                                    ( pthread_cond_t                      & cond );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               recover                                 ( int                                   res );
+};
+//=============================================================================================================================================================
+/**
+ * Front of a company in the front process. The feeder thread writes the packs of the company to a shard, the collector
+ * thread reads their results back and returns the packs to the company. The shard returns the results of a company
+ * in the order of its packs, the front matches them against the packs it keeps in that order.
+ */
+class CShardFront
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CShardFront                             ( ACompany                              company,
+                                                                                 CShmPipe                            & packs,
+                                                                                 CShmPipe                            & results );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CShardFront                             ( const CShardFront                   & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    CShardFront                      & operator =                              ( const CShardFront                   & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               start                                   ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @return true if all the packs came back with a result for each problem
+     */
+    bool                               join                                    ( void );
+  private:
+    ACompany                           m_Company;
+    CShmPipe                         & m_Packs;
+    CShmPipe                         & m_Results;
+    std::thread                        m_Feeder;
+    std::thread                        m_Collector;
+    std::mutex                         m_Mtx;                                   // m_Pending is shared by the feeder and the collector
+    std::deque<AProblemPack>           m_Pending;
+    bool                               m_Failed { false };                      // set by the collector
+
+    void                               feed                                    ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    void                               collect                                 ( void );
+};
+//=============================================================================================================================================================
+/**
+ * A company of the front process as seen by an optimizer in a shard process.
+ */
+class CCompanyShard : public CCompany
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CCompanyShard                           ( CShmPipe                            & packs,
+                                                                                 CShmPipe                            & results );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual AProblemPack               waitForPack                             ( void ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual void                       solvedPack                              ( AProblemPack                          pack ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Closes both pipes, the front sees the end of the results.
+     */
+    void                               finish                                  ( void );
+  private:
+    CShmPipe                         & m_Packs;
+    CShmPipe                         & m_Results;
+    std::vector<char>                  m_Buffer;                                // record being read, used by the receiver only
+};
+using ACompanyShard = std::shared_ptr<CCompanyShard>;
+//=============================================================================================================================================================
+/**
+ * Splits the companies among shards child processes, company i goes to shard i % shards. Each child calls worker with
+ * its index and companies and exits, the calling process feeds them the packs and returns the results to the companies. Threads
+ * must not be running in the calling process yet, only the forking one survives in the children.
+ * @param[in] budget      problems the progtest solvers of all the shards may take together, the worker gets it shared
+ *                        by the processes, a negative one passes nullptr
+ * @return true if all the children exited successfully and all the packs came back
+ */
+bool                                   runSharded                              ( const std::vector<ACompany>         & companies,
+                                                                                 size_t                                shards,
+                                                                                 int64_t                               budget,
+                                                                                 const std::function<void ( size_t,
+                                                                                                            const std::vector<ACompany> &,
+                                                                                                            std::atomic<int64_t> * )> & worker );
+//=============================================================================================================================================================
+#endif /* SHARD_TESTER_H_3091827465019283 */
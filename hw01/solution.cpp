@@ -37,6 +37,11 @@
 #include <semaphore.h>
 #include "progtest_solver.h"
 #include "sample_tester.h"
+#ifdef BENCHMARK
+#include "bench_tester.h"
+#include "trace_tester.h"
+#include "shard_tester.h"
+#endif /* BENCHMARK */
 
 using namespace std;
 #endif /* __PROGTEST__ */
@@ -46,125 +51,2414 @@ using namespace std;
 
 //atomic_int workerCounter = 0;
 
-class CProblemPackWrapper {
+static uint64_t nowNs () {
+    return chrono::duration_cast<chrono::nanoseconds> ( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+/**
+ * Timeline of spans in per-thread ring buffers, written out in the Chrome trace format. A thread only ever writes
+ * into its own buffer, the buffers are read once all the traced threads have been joined.
+ */
+class CTracer {
+private:
+    struct TSpan {
+        const char * m_Name;
+        uint64_t m_Begin;
+        uint64_t m_End;
+    };
+    struct TBuffer {
+        static constexpr size_t CAPACITY = 1 << 15; // older spans get overwritten
+        vector<TSpan> m_Spans = vector<TSpan> ( CAPACITY );
+        uint64_t m_Count = 0;
+        const char * m_ThreadName = "thread";
+    };
+    static inline atomic<CTracer *> s_Active { nullptr };
+    static inline atomic_uint64_t s_Generation { 0 };
+    static inline thread_local TBuffer * t_Buffer = nullptr;
+    static inline thread_local uint64_t t_Generation = 0;   // of the tracer t_Buffer belongs to
+    static inline thread_local const char * t_ThreadName = "thread";
+
+    uint64_t m_Generation = ++s_Generation;
+    uint64_t m_Start = nowNs();
+    mutex m_Mtx;                                             // guards m_Buffers
+    vector<unique_ptr<TBuffer>> m_Buffers;
+
+    TBuffer * buffer () {
+        if ( t_Generation != m_Generation ) {
+            unique_lock<mutex> ul ( m_Mtx );
+            m_Buffers.push_back ( make_unique<TBuffer> () );
+            t_Buffer = m_Buffers.back().get();
+            t_Buffer->m_ThreadName = t_ThreadName;
+            t_Generation = m_Generation;
+        }
+        return t_Buffer;
+    }
+public:
+    /**
+     * @return the tracer spans go to, nullptr while not tracing
+     */
+    static CTracer * active () { return s_Active.load ( memory_order_relaxed ); }
+    static void activate ( CTracer * tracer ) { s_Active.store ( tracer ); }
+    /**
+     * Names the calling thread in the timeline.
+     */
+    static void threadName ( const char * name ) {
+        t_ThreadName = name;
+        if ( CTracer * tracer = active() )
+            tracer->buffer()->m_ThreadName = name;
+    }
+    void add ( const char * name, uint64_t begin, uint64_t end ) {
+        TBuffer * buf = buffer();
+        buf->m_Spans[buf->m_Count++ % TBuffer::CAPACITY] = { name, begin, end };
+    }
+    /**
+     * Writes the spans as complete events ( "ph":"X" ), times in us.
+     */
+    void dump ( FILE * fp ) {
+        unique_lock<mutex> ul ( m_Mtx );
+        fprintf ( fp, "{\"traceEvents\":[\n" );
+        const char * sep = "";
+        for ( size_t tid = 0; tid < m_Buffers.size(); tid++ ) {
+            const TBuffer & buf = *m_Buffers[tid];
+            fprintf ( fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}",
+                      sep, tid, buf.m_ThreadName, tid );
+            sep = ",\n";
+            uint64_t from = buf.m_Count > TBuffer::CAPACITY ? buf.m_Count - TBuffer::CAPACITY : 0;
+            for ( uint64_t i = from; i < buf.m_Count; i++ ) {
+                const TSpan & span = buf.m_Spans[i % TBuffer::CAPACITY];
+                fprintf ( fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                          sep, span.m_Name, tid, ( span.m_Begin - m_Start ) / 1e3, ( span.m_End - span.m_Begin ) / 1e3 );
+            }
+        }
+        fprintf ( fp, "\n]}\n" );
+    }
+};
+
+/**
+ * Records the lifetime of the object as a span, if tracing.
+ */
+class CTraceSpan {
 private:
+    CTracer * m_Tracer;
+    const char * m_Name;
+    uint64_t m_Begin;
 public:
-    explicit CProblemPackWrapper ( AProblemPack pPack )
-    : m_ProblemPack ( std::move ( pPack ) ) {}
+    explicit CTraceSpan ( const char * name )
+    : m_Tracer ( CTracer::active() ), m_Name ( name ), m_Begin ( m_Tracer ? nowNs() : 0 ) {}
+    CTraceSpan ( const CTraceSpan & ) = delete;
+    CTraceSpan & operator = ( const CTraceSpan & ) = delete;
+    ~CTraceSpan () {
+        if ( m_Tracer )
+            m_Tracer->add ( m_Name, m_Begin, nowNs() );
+    }
+};
 
-    bool isSolved () {
-        for ( const auto & problem : m_ProblemPack->m_Problems )
-            if ( problem->m_MaxProfit == 0 )
-                return false;
+/**
+ * Locks the mutex, records the wait as a span if it was contended and tracing is on.
+ */
+static unique_lock<mutex> lockTraced ( mutex & mtx, const char * name ) {
+    if ( ! CTracer::active() )
+        return unique_lock<mutex> ( mtx );
+    unique_lock<mutex> ul ( mtx, try_to_lock );
+    if ( ! ul.owns_lock() ) {
+        CTraceSpan span ( name );
+        ul.lock();
+    }
+    return ul;
+}
+
+/**
+ * Lock-free latency histogram, 8 buckets per power of two ( at most 12.5 % error ).
+ */
+class CHistogram {
+private:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = 64 * SUB;
+    array<atomic_uint64_t, BUCKETS> m_Buckets {};
+    atomic_uint64_t m_Count { 0 };
+    atomic_uint64_t m_Max { 0 };
+
+    static size_t index ( uint64_t value ) {
+        if ( value < SUB )
+            return value;
+        int msb = 63 - __builtin_clzll ( value );
+        return ( msb - SUB_BITS + 1 ) * SUB + ( ( value >> ( msb - SUB_BITS ) ) & ( SUB - 1 ) );
+    }
+    /** Smallest value of the bucket after idx. */
+    static uint64_t upperBound ( size_t idx ) {
+        idx++;
+        if ( idx < SUB )
+            return idx;
+        int msb = idx / SUB + SUB_BITS - 1;
+        return uint64_t ( SUB + idx % SUB ) << ( msb - SUB_BITS );
+    }
+public:
+    void add ( uint64_t value ) {
+        m_Buckets[index ( value )].fetch_add ( 1, memory_order_relaxed );
+        m_Count.fetch_add ( 1, memory_order_relaxed );
+        uint64_t prev = m_Max.load ( memory_order_relaxed );
+        while ( prev < value && ! m_Max.compare_exchange_weak ( prev, value, memory_order_relaxed ) ) {}
+    }
+    uint64_t count () const { return m_Count.load ( memory_order_relaxed ); }
+    uint64_t maxValue () const { return m_Max.load ( memory_order_relaxed ); }
+    /**
+     * @param[in] fraction 0.5 for the median, 0.99 for p99 ...
+     * @return upper bound of the bucket holding the percentile
+     */
+    uint64_t percentile ( double fraction ) const {
+        uint64_t total = count();
+        if ( total == 0 )
+            return 0;
+        uint64_t rank = max ( uint64_t ( 1 ), uint64_t ( ceil ( fraction * total ) ) ), seen = 0;
+        for ( size_t i = 0; i < BUCKETS; i++ )
+            if ( ( seen += m_Buckets[i].load ( memory_order_relaxed ) ) >= rank )
+                return min ( upperBound ( i ), maxValue() );
+        return maxValue();
+    }
+    void print ( ostream & os, const char * name ) const {
+        os << "  " << setw ( 12 ) << left << name << right
+           << " n " << setw ( 8 ) << count()
+           << "  p50 " << setw ( 9 ) << percentile ( 0.5 ) / 1000
+           << "  p99 " << setw ( 9 ) << percentile ( 0.99 ) / 1000
+           << "  p999 " << setw ( 9 ) << percentile ( 0.999 ) / 1000
+           << "  max " << setw ( 9 ) << maxValue() / 1000 << " us\n";
+    }
+};
+
+/**
+ * Pipeline counters of the optimizer, updated without locks. Only allocated when enabled,
+ * the instrumented code checks a null pointer otherwise.
+ */
+class CStats {
+public:
+    CHistogram m_Intake;       // pack received -> all its problems placed into solvers
+    CHistogram m_SolveWait;    // placed -> last problem solved
+    CHistogram m_ReturnWait;   // solved -> returned to the company
+    CHistogram m_Turnaround;   // received -> returned
+    CHistogram m_SolverFill;   // problems in a stashed solver
+    atomic_uint64_t m_PacksReceived { 0 };
+    atomic_uint64_t m_PacksReturned { 0 };
+    atomic_uint64_t m_ProblemsReceived { 0 };
+    atomic_uint64_t m_FullSolvers { 0 };       // stashed because they got full
+    atomic_uint64_t m_PartialSolvers { 0 };    // stashed early by the flush policy, or the last one
+    atomic_uint64_t m_WorkerBusyNs { 0 };
+    atomic_uint64_t m_WorkerIdleNs { 0 };
+    atomic_uint64_t m_WorkersStarted { 0 };
+    atomic_uint64_t m_WorkersRetired { 0 };    // exited by shrinking the pool
+    atomic_uint64_t m_SplitProblems { 0 };
+    atomic_uint64_t m_SplitParts { 0 };        // solved separately, the others were summed up right away
+    atomic_uint64_t m_SolversInline { 0 };     // created under the filling lock, the provisioning fell behind
+    atomic_uint64_t m_SolversUseless { 0 };    // null, zero capacity or over the shared budget, replaced by native ones
+    atomic_uint64_t m_OverSpare { 0 };         // partial progtest solvers forced out beyond the spare capacity
+};
+
+/**
+ * Minimal intrusive smart pointer, T provides addRef () and release ().
+ */
+template <typename T>
+class CRef {
+private:
+    T * m_Ptr = nullptr;
+public:
+    CRef () = default;
+    CRef ( nullptr_t ) {}
+    explicit CRef ( T * ptr ) : m_Ptr ( ptr ) { if ( m_Ptr ) m_Ptr->addRef(); }
+    CRef ( const CRef & other ) : m_Ptr ( other.m_Ptr ) { if ( m_Ptr ) m_Ptr->addRef(); }
+    CRef ( CRef && other ) noexcept : m_Ptr ( other.m_Ptr ) { other.m_Ptr = nullptr; }
+    ~CRef () { if ( m_Ptr ) m_Ptr->release(); }
+    CRef & operator = ( CRef other ) noexcept { swap ( m_Ptr, other.m_Ptr ); return *this; }
+
+    T * operator -> () const { return m_Ptr; }
+    T & operator * () const { return *m_Ptr; }
+    T * get () const { return m_Ptr; }
+    explicit operator bool () const { return m_Ptr != nullptr; }
+    bool operator == ( const CRef & other ) const { return m_Ptr == other.m_Ptr; }
+    bool operator != ( const CRef & other ) const { return m_Ptr != other.m_Ptr; }
+    bool operator == ( nullptr_t ) const { return m_Ptr == nullptr; }
+    bool operator != ( nullptr_t ) const { return m_Ptr != nullptr; }
+    /**
+     * Gives up the reference without releasing it, for containers of raw pointers.
+     */
+    T * detach () { T * ptr = m_Ptr; m_Ptr = nullptr; return ptr; }
+    /**
+     * Takes over a reference given up by detach ().
+     */
+    static CRef adopt ( T * ptr ) { CRef ref; ref.m_Ptr = ptr; return ref; }
+};
+
+/**
+ * FIFO on a growing circular buffer. Unlike deque, it keeps its memory when drained.
+ */
+template <typename T>
+class CRing {
+private:
+    vector<T> m_Data;   // size is zero or a power of two
+    size_t m_Head = 0;
+    size_t m_Size = 0;
+
+    void grow () {
+        vector<T> data ( max ( size_t ( 16 ), 2 * m_Data.size() ) );
+        for ( size_t i = 0; i < m_Size; i++ )
+            data[i] = std::move ( m_Data[( m_Head + i ) & ( m_Data.size() - 1 )] );
+        m_Data.swap ( data );
+        m_Head = 0;
+    }
+public:
+    bool empty () const { return m_Size == 0; }
+    size_t size () const { return m_Size; }
+    T & front () { return m_Data[m_Head]; }
+    const T & front () const { return m_Data[m_Head]; }
+    T & operator [] ( size_t idx ) { return m_Data[( m_Head + idx ) & ( m_Data.size() - 1 )]; }
+    void push_back ( T item ) {
+        if ( m_Size == m_Data.size() )
+            grow();
+        m_Data[( m_Head + m_Size++ ) & ( m_Data.size() - 1 )] = std::move ( item );
+    }
+    /**
+     * Removes the front item, move it out with front() first to keep it.
+     */
+    void pop_front () {
+        m_Data[m_Head] = T ();
+        m_Head = ( m_Head + 1 ) & ( m_Data.size() - 1 );
+        m_Size--;
+    }
+};
+
+/**
+ * Condition variable that spins a while before it parks. Most waits at high pack rates take microseconds, a spinning
+ * waiter sees the notification without a futex sleep and the notifier skips the futex wake. The spin budget follows
+ * the observed waits: it moves towards twice the spinning that paid off, and halves while the waits end up parked.
+ * Notifications must be made under the mutex the waiters hold.
+ */
+class CSpinPark {
+private:
+    condition_variable m_CV;
+    atomic_uint64_t m_Epoch { 0 };  // bumped by every notification
+    atomic_uint32_t m_Budget;       // pauses to spin at most before parking
+    size_t m_Parked = 0;            // under the mutex of the waiters
+
+    static void pause () {
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+        __builtin_ia32_pause();
+#elif defined ( __aarch64__ )
+        __asm__ __volatile__ ( "yield" );
+#endif /* __x86_64__ || __i386__ */
+    }
+    static uint32_t clampBudget ( uint64_t budget ) {
+        return uint32_t ( min ( uint64_t ( s_MaxSpin ), max ( uint64_t ( MIN_SPIN ), budget ) ) );
+    }
+    void adapt ( uint32_t target ) {
+        int64_t budget = m_Budget.load ( memory_order_relaxed );
+        m_Budget.store ( clampBudget ( budget + ( int64_t ( target ) - budget ) / 8 ), memory_order_relaxed );
+    }
+public:
+    // a single core cannot run the notifier while the waiter spins, so it never spins there
+    static inline uint32_t s_MaxSpin = thread::hardware_concurrency() > 1 ? 4096 : 0;  // set before constructing
+    static constexpr uint32_t MIN_SPIN = 16;
+    atomic_uint64_t m_SpinHits { 0 };  // waits ended while spinning
+    atomic_uint64_t m_Parks { 0 };     // waits that parked
+
+    CSpinPark () : m_Budget ( clampBudget ( s_MaxSpin / 16 ) ) {}
+
+    void notifyOne () {
+        m_Epoch.fetch_add ( 1, memory_order_relaxed );
+        if ( m_Parked )
+            m_CV.notify_one();
+    }
+    void notifyAll () {
+        m_Epoch.fetch_add ( 1, memory_order_relaxed );
+        if ( m_Parked )
+            m_CV.notify_all();
+    }
+    /**
+     * Waits for a notification, spinning without the lock first. May return spuriously.
+     * @param[in] deadline time_point::max () waits without a limit
+     * @return false if the deadline passed
+     */
+    bool waitUntil ( unique_lock<mutex> & ul, chrono::steady_clock::time_point deadline ) {
+        uint64_t epoch = m_Epoch.load ( memory_order_relaxed );
+        if ( uint32_t budget = s_MaxSpin ? m_Budget.load ( memory_order_relaxed ) : 0 ) {
+            ul.unlock();
+            uint32_t spun = 0;
+            for ( uint32_t step = 1; spun < budget && m_Epoch.load ( memory_order_relaxed ) == epoch; step = min ( 2 * step, 64u ) ) {
+                for ( uint32_t i = 0; i < step; i++ )
+                    pause();
+                spun += step;
+            }
+            ul.lock();
+            if ( m_Epoch.load ( memory_order_relaxed ) != epoch ) {
+                m_SpinHits.fetch_add ( 1, memory_order_relaxed );
+                adapt ( 2 * spun );
+                return true;
+            }
+            adapt ( budget / 2 );
+        }
+        m_Parks.fetch_add ( 1, memory_order_relaxed );
+        m_Parked++;
+        bool notified = true;
+        if ( deadline == chrono::steady_clock::time_point::max() )
+            m_CV.wait ( ul );
+        else
+            notified = m_CV.wait_until ( ul, deadline ) == cv_status::no_timeout;
+        m_Parked--;
+        return notified;
+    }
+    template <typename TPred>
+    void wait ( unique_lock<mutex> & ul, TPred ready ) {
+        while ( ! ready() )
+            waitUntil ( ul, chrono::steady_clock::time_point::max() );
+    }
+    /**
+     * @return the final value of ready
+     */
+    template <typename TPred>
+    bool waitFor ( unique_lock<mutex> & ul, chrono::microseconds timeout, TPred ready ) {
+        auto deadline = chrono::steady_clock::now() + timeout;
+        while ( ! ready() )
+            if ( ! waitUntil ( ul, deadline ) )
+                return ready();
         return true;
     }
+    uint32_t budget () const { return m_Budget.load ( memory_order_relaxed ); }
+};
+
+class CSafePPackQueue;
+
+/**
+ * Pack wrappers are owned by the queue of their company and recycled there once the last reference is gone.
+ */
+class CProblemPackWrapper {
+private:
+    atomic_size_t m_Unsolved { 0 }; // number of problems of the pack not yet solved by any solver
+    atomic_uint32_t m_Refs { 0 };
+public:
+    explicit CProblemPackWrapper ( CSafePPackQueue & owner )
+    : m_Owner ( owner ) {}
+    /**
+     * Prepares a new or a recycled wrapper for the next pack.
+     */
+    void init ( AProblemPack pPack, CStats * stats ) {
+        m_Unsolved.store ( pPack->m_Problems.size(), memory_order_relaxed );
+        m_ProblemPack = std::move ( pPack );
+        m_Stats = stats;
+        m_Solved.store ( 0, memory_order_relaxed );
+        if ( m_Stats ) {
+            m_Received = nowNs();
+            m_Placed.store ( m_Received, memory_order_relaxed ); // an empty pack is placed right away
+        }
+    }
+    void addRef () { m_Refs.fetch_add ( 1, memory_order_relaxed ); }
+    void release ();
+    /**
+     * Marks problems of the pack as solved.
+     * @param[in] count number of the solved problems
+     * @return true if they were the last unsolved problems of the pack
+     */
+    bool problemsSolved ( size_t count ) { return m_Unsolved.fetch_sub ( count, memory_order_acq_rel ) == count; }
+    /**
+     * Marks problems of the pack as solved, wakes the returner if the pack is complete.
+     */
+    void finishProblems ( size_t count );
+
+    bool isSolved () const { return m_Unsolved.load ( memory_order_acquire ) == 0; }
     AProblemPack m_ProblemPack;
+    CSafePPackQueue & m_Owner; // queue of the company the pack came from
+    CStats * m_Stats = nullptr; // nullptr when the statistics are disabled
+    // timestamps in ns, taken only with statistics enabled
+    uint64_t m_Received = 0;
+    size_t m_Unplaced = 0;           // problems and parts not in a solver yet, under the filling lock
+    atomic_uint64_t m_Placed { 0 };  // a coalesced pack may get solved by a worker while the receiver sets it
+    atomic_uint64_t m_Solved { 0 }; // the returner may see the pack solved before the worker stores it
 };
 
-using AProblemPackWrapper = shared_ptr<CProblemPackWrapper>;
+using AProblemPackWrapper = CRef<CProblemPackWrapper>;
 
-class CProblemWrapper {
+/**
+ * In-process solver with the interface of the progtest one, but without any global capacity budget.
+ * The rental problem is solved as a min-cost flow: time points form a chain of edges with capacity m_Count,
+ * each interval is an edge of capacity 1 and cost -payment, at most m_Count units of flow are pushed.
+ */
+class CNativeSolver : public CProgtestSolver {
+private:
+    struct TEdge {
+        int m_To;
+        int m_Cap;
+        int m_Cost;
+        int m_Next; // next edge leaving the same node, -1 at the end
+    };
+    size_t m_Capacity;
+    vector<AProblem> m_Problems;
+    bool m_Solved = false;
 public:
-    explicit CProblemWrapper ( AProblem prob, AProblemPackWrapper probPack )
-    : m_Problem ( std::move ( prob ) ), m_ParentProblemPack ( std::move ( probPack ) ) {}
-    AProblem m_Problem;
-    AProblemPackWrapper m_ParentProblemPack;
+    explicit CNativeSolver ( size_t capacity )
+    : m_Capacity ( capacity ) {}
+
+    bool hasFreeCapacity () const override { return m_Problems.size() < m_Capacity; }
+    bool addProblem ( AProblem problem ) override {
+        if ( ! hasFreeCapacity() )
+            return false;
+        m_Problems.push_back ( std::move ( problem ) );
+        return true;
+    }
+    void reset () {
+        m_Problems.clear();
+        m_Solved = false;
+    }
+    /**
+     * Solves the problems in batches of BATCH_LANES, or one by one if s_Batched is not set.
+     */
+    size_t solve () override;
+    /**
+     * Computes the best profit of a single problem, intervals are closed ( [from, to] ).
+     * Dispatches the common small counts to the specialized kernels.
+     */
+    static int maxProfit ( const CProblem & problem );
+    /**
+     * Solves up to BATCH_LANES problems in lockstep, one per lane of a vector, with AVX2 if the CPU has it.
+     * The problems of count 1 are solved in the lanes, those of count 2 or 3 only if they never need more items
+     * than they have, the others and the ones longer than BATCH_INTERVALS by maxProfit. Gives the same results.
+     */
+    static void solveBatch ( const AProblem * problems, size_t count );
+
+    static constexpr size_t BATCH_LANES = 8;
+    static constexpr size_t BATCH_INTERVALS = 16;
+    static inline bool s_Batched = true;  // mode switch of solve()
+    /**
+     * Splits a problem along the gaps no interval spans. Intervals without a payment never add profit and are dropped,
+     * parts that never need more than m_Count items are summed up right away.
+     * @param[out] parts the parts left to be solved
+     * @param[out] base profit of the parts summed up right away
+     * @return false if a part would hold most of the intervals, solving it would take about as long as the whole
+     *         problem, nothing is split then
+     */
+    static bool split ( const CProblem & problem, vector<AProblem> & parts, int & base );
+    /**
+     * Rough cost of maxProfit, it augments at most min ( count, intervals ) times over a graph of the intervals.
+     */
+    static uint64_t estimateCost ( const CProblem & problem ) {
+        uint64_t n = problem.m_Intervals.size();
+        return n * min ( n, uint64_t ( max ( 1, problem.m_Count ) ) ) + 1;
+    }
+private:
+    /**
+     * The general algorithm, min-cost flow with Bellman-Ford, for any count.
+     */
+    static int maxProfitGeneral ( const CProblem & problem );
+    /**
+     * Kernel for a count known at compile time, works on the sorted intervals as parallel arrays.
+     */
+    template <int K>
+    static int maxProfitSmall ( const CProblem & problem );
 };
 
-using AProblemWrapper = shared_ptr<CProblemWrapper>;
+bool CNativeSolver::split ( const CProblem & problem, vector<AProblem> & parts, int & base ) {
+    // buffers are reused by the calling receiver
+    static thread_local vector<CInterval> sorted;
+    static thread_local vector<int> ends;
+    base = 0;
+    if ( problem.m_Count <= 0 )
+        return true;
+    sorted.clear();
+    for ( const auto & interval : problem.m_Intervals )
+        if ( interval.m_Payment > 0 )
+            sorted.push_back ( interval );
+    sort ( sorted.begin(), sorted.end(), [] ( const CInterval & a, const CInterval & b ) { return a.m_From < b.m_From; } );
 
-class CSolverWrapper{
+    // the longest stretch without a gap first, it is cheap and most problems are not worth splitting
+    size_t longest = 0;
+    for ( size_t i = 0, begin = 0, end = 0; i < sorted.size(); i++ ) {
+        if ( i == begin || sorted[i].m_From > sorted[end].m_To )
+            begin = end = i;
+        else if ( sorted[i].m_To > sorted[end].m_To )
+            end = i;
+        longest = max ( longest, i + 1 - begin );
+    }
+    if ( longest * 4 > problem.m_Intervals.size() * 3 )
+        return false;
+
+    size_t begin = 0;
+    int end = INT_MIN;      // the latest end of the part being collected
+    for ( size_t i = 0; i <= sorted.size(); i++ ) {
+        // intervals are closed, a part ends once the next one starts after all of it
+        if ( i > begin && ( i == sorted.size() || sorted[i].m_From > end ) ) {
+            // the most intervals open at once, ends of the open ones in a min heap
+            size_t depth = 0;
+            int total = 0;
+            ends.clear();
+            for ( size_t j = begin; j < i; j++ ) {
+                while ( ! ends.empty() && ends.front() < sorted[j].m_From ) {
+                    pop_heap ( ends.begin(), ends.end(), greater<int> () );
+                    ends.pop_back();
+                }
+                ends.push_back ( sorted[j].m_To );
+                push_heap ( ends.begin(), ends.end(), greater<int> () );
+                depth = max ( depth, ends.size() );
+                total += sorted[j].m_Payment;
+            }
+            if ( depth <= size_t ( problem.m_Count ) )
+                base += total;
+            else {
+                parts.push_back ( make_shared<CProblem> ( problem.m_Count, initializer_list<CInterval> {} ) );
+                parts.back()->m_Intervals.assign ( sorted.begin() + begin, sorted.begin() + i );
+            }
+            begin = i;
+        }
+        if ( i < sorted.size() )
+            end = i == begin ? sorted[i].m_To : max ( end, sorted[i].m_To );
+    }
+    return true;
+}
+
+/**
+ * The intervals of a problem as parallel arrays for the kernels, reused by the calling worker.
+ */
+struct TKernelBuffers {
+    vector<uint64_t> m_Keys;          // sort keys of the intervals or of their ends
+    vector<int> m_From, m_To, m_Payment;
+    vector<int> m_ByFrom, m_ByTo, m_FromStart, m_ToStart; // interval indices grouped by their points
+    vector<int> m_Chain, m_Dist, m_Pred, m_Best;
+    vector<char> m_Used;
+};
+static thread_local TKernelBuffers t_KernelBuffers;
+
+/**
+ * Weighted interval scheduling: sorted by the ends, the best profit of the first i intervals either skips
+ * the i-th one, or takes it after the best of those ending before it starts.
+ */
+template <>
+int CNativeSolver::maxProfitSmall<1> ( const CProblem & problem ) {
+    TKernelBuffers & b = t_KernelBuffers;
+    // the end in the high bits, the index in the low ones, a single sort of plain integers
+    b.m_Keys.clear();
+    for ( size_t i = 0; i < problem.m_Intervals.size(); i++ )
+        if ( problem.m_Intervals[i].m_Payment > 0 )
+            b.m_Keys.push_back ( uint64_t ( int64_t ( problem.m_Intervals[i].m_To ) - INT_MIN ) << 32 | i );
+    sort ( b.m_Keys.begin(), b.m_Keys.end() );
+    size_t n = b.m_Keys.size();
+    b.m_From.resize ( n );
+    b.m_To.resize ( n );
+    b.m_Payment.resize ( n );
+    for ( size_t i = 0; i < n; i++ ) {
+        const CInterval & interval = problem.m_Intervals[uint32_t ( b.m_Keys[i] )];
+        b.m_From[i] = interval.m_From;
+        b.m_To[i] = interval.m_To;
+        b.m_Payment[i] = interval.m_Payment;
+    }
+    b.m_Best.resize ( n + 1 );
+    b.m_Best[0] = 0;
+    for ( size_t i = 0; i < n; i++ ) {
+        // intervals are closed, the previous one has to end before this one starts
+        size_t prev = lower_bound ( b.m_To.begin(), b.m_To.begin() + i, b.m_From[i] ) - b.m_To.begin();
+        b.m_Best[i + 1] = max ( b.m_Best[i], b.m_Best[prev] + b.m_Payment[i] );
+    }
+    return b.m_Best[n];
+}
+
+/**
+ * Min-cost flow of K units over the time points like maxProfitGeneral, specialized to its graph: a chain of
+ * capacity K and an edge per interval, kept as parallel arrays instead of adjacency lists. All the edges
+ * of the residual graph lead either forward or backward in time, so the shortest paths are found by alternating
+ * an ascending and a descending sweep, each of them settles the paths that do not change the direction.
+ */
+template <int K>
+int CNativeSolver::maxProfitSmall ( const CProblem & problem ) {
+    TKernelBuffers & b = t_KernelBuffers;
+    // the points in the high bits, the interval and whether it is its end in the low ones
+    b.m_Keys.clear();
+    b.m_Payment.clear();
+    for ( const auto & interval : problem.m_Intervals )
+        if ( interval.m_Payment > 0 ) {
+            uint64_t id = b.m_Payment.size();
+            b.m_Keys.push_back ( uint64_t ( int64_t ( interval.m_From ) - INT_MIN ) << 31 | id << 1 );
+            b.m_Keys.push_back ( uint64_t ( int64_t ( interval.m_To ) + 1 - INT_MIN ) << 31 | id << 1 | 1 );
+            b.m_Payment.push_back ( interval.m_Payment );
+        }
+    int m = b.m_Payment.size();
+    if ( m == 0 )
+        return 0;
+    sort ( b.m_Keys.begin(), b.m_Keys.end() );
+    b.m_From.resize ( m );
+    b.m_To.resize ( m );
+    int n = 0, depth = 0, maxDepth = 0, total = 0;
+    for ( size_t j = 0; j < b.m_Keys.size(); j++ ) {
+        // the intervals open at a point are known once all of its ends are seen
+        if ( j > 0 && b.m_Keys[j] >> 31 != b.m_Keys[j - 1] >> 31 ) {
+            maxDepth = max ( maxDepth, depth );
+            n++;
+        }
+        int id = ( b.m_Keys[j] >> 1 ) & 0x3fffffff;
+        if ( b.m_Keys[j] & 1 ) {
+            b.m_To[id] = n;
+            depth--;
+        }
+        else {
+            b.m_From[id] = n;
+            depth++;
+            total += b.m_Payment[id];
+        }
+    }
+    n++;
+    // enough items to rent every interval, no need to pick
+    if ( maxDepth <= K )
+        return total;
+    // the intervals leaving and entering each point, by counting sort
+    auto group = [ n, m ] ( const vector<int> & node, vector<int> & start, vector<int> & order ) {
+        start.assign ( n + 1, 0 );
+        for ( int i = 0; i < m; i++ )
+            start[node[i]]++;
+        for ( int v = 0; v < n; v++ )
+            start[v + 1] += start[v];
+        order.resize ( m );
+        for ( int i = m - 1; i >= 0; i-- )
+            order[--start[node[i]]] = i;
+    };
+    group ( b.m_From, b.m_FromStart, b.m_ByFrom );
+    group ( b.m_To, b.m_ToStart, b.m_ByTo );
+
+    b.m_Chain.assign ( n, 0 );
+    b.m_Used.assign ( m, 0 );
+    b.m_Dist.resize ( n );
+    b.m_Pred.resize ( n );
+    // the arrays are not resized any more, plain pointers keep the sweeps in registers
+    int * dist = b.m_Dist.data(), * chain = b.m_Chain.data();   // chain = flow from v to v + 1
+    int * pred = b.m_Pred.data();   // v - 1 -> v is -1, v + 1 -> v is -2, interval i is i, its reverse is m + i
+    const int * from = b.m_From.data(), * to = b.m_To.data(), * payment = b.m_Payment.data();
+    const int * byFrom = b.m_ByFrom.data(), * byTo = b.m_ByTo.data();
+    const int * fromStart = b.m_FromStart.data(), * toStart = b.m_ToStart.data();
+    char * used = b.m_Used.data();
+    for ( int flow = 0; flow < K; flow++ ) {
+        fill ( dist, dist + n, INT_MAX );
+        dist[0] = 0;
+        for ( bool changed = true; changed; ) {
+            // every point stays reachable along the chain
+            for ( int v = 0; v < n; v++ ) {
+                if ( v + 1 < n && chain[v] < K && dist[v] < dist[v + 1] ) {
+                    dist[v + 1] = dist[v];
+                    pred[v + 1] = -1;
+                }
+                for ( int e = fromStart[v]; e < fromStart[v + 1]; e++ ) {
+                    int i = byFrom[e];
+                    if ( ! used[i] && dist[v] - payment[i] < dist[to[i]] ) {
+                        dist[to[i]] = dist[v] - payment[i];
+                        pred[to[i]] = i;
+                    }
+                }
+            }
+            // the backward edges carry flow, there are none before the first path
+            changed = false;
+            for ( int v = flow ? n - 1 : 0; v > 0; v-- ) {
+                if ( dist[v] == INT_MAX )
+                    continue;
+                if ( chain[v - 1] > 0 && dist[v] < dist[v - 1] ) {
+                    dist[v - 1] = dist[v];
+                    pred[v - 1] = -2;
+                    changed = true;
+                }
+                for ( int e = toStart[v]; e < toStart[v + 1]; e++ ) {
+                    int i = byTo[e];
+                    if ( used[i] && dist[v] + payment[i] < dist[from[i]] ) {
+                        dist[from[i]] = dist[v] + payment[i];
+                        pred[from[i]] = m + i;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        // no path adds any profit, renting more items would not help
+        if ( dist[n - 1] >= 0 )
+            break;
+        for ( int v = n - 1; v != 0; ) {
+            int edge = pred[v];
+            if ( edge == -1 )
+                chain[--v]++;
+            else if ( edge == -2 )
+                chain[v++]--;
+            else if ( edge < m ) {
+                used[edge] = 1;
+                v = from[edge];
+            }
+            else {
+                used[edge - m] = 0;
+                v = to[edge - m];
+            }
+        }
+    }
+    int profit = 0;
+    for ( int i = 0; i < m; i++ )
+        if ( used[i] )
+            profit += payment[i];
+    return profit;
+}
+
+int CNativeSolver::maxProfit ( const CProblem & problem ) {
+    switch ( problem.m_Count ) {
+        case 1:  return maxProfitSmall<1> ( problem );
+        case 2:  return maxProfitSmall<2> ( problem );
+        case 3:  return maxProfitSmall<3> ( problem );
+        default: return maxProfitGeneral ( problem );
+    }
+}
+
+int CNativeSolver::maxProfitGeneral ( const CProblem & problem ) {
+    // buffers are reused by the calling worker, no allocation once they have grown
+    static thread_local vector<int> points, overlap, head, dist, pred;
+    static thread_local vector<TEdge> edges;
+
+    points.clear();
+    for ( const auto & interval : problem.m_Intervals ) {
+        points.push_back ( interval.m_From );
+        points.push_back ( interval.m_To + 1 );
+    }
+    sort ( points.begin(), points.end() );
+    points.erase ( unique ( points.begin(), points.end() ), points.end() );
+    int n = points.size();
+    if ( n == 0 || problem.m_Count <= 0 )
+        return 0;
+    auto node = [] ( int time ) { return int ( lower_bound ( points.begin(), points.end(), time ) - points.begin() ); };
+
+    // enough items to rent every interval, no need to pick
+    overlap.assign ( n, 0 );
+    int total = 0;
+    for ( const auto & interval : problem.m_Intervals ) {
+        overlap[node ( interval.m_From )]++;
+        overlap[node ( interval.m_To + 1 )]--;
+        total += max ( 0, interval.m_Payment ); // the ones without a payment are not worth renting
+    }
+    int depth = 0, maxDepth = 0;
+    for ( int i = 0; i < n; i++ )
+        maxDepth = max ( maxDepth, depth += overlap[i] );
+    if ( maxDepth <= problem.m_Count )
+        return total;
+
+    // residual graph in intrusive adjacency lists, edge i and i ^ 1 are a pair
+    edges.clear();
+    head.assign ( n, -1 );
+    auto addEdge = [] ( int from, int to, int cap, int cost ) {
+        edges.push_back ( { to, cap, cost, head[from] } ); head[from] = edges.size() - 1;
+        edges.push_back ( { from, 0, -cost, head[to] } );  head[to] = edges.size() - 1;
+    };
+    for ( int i = 0; i + 1 < n; i++ )
+        addEdge ( i, i + 1, problem.m_Count, 0 );
+    for ( const auto & interval : problem.m_Intervals )
+        addEdge ( node ( interval.m_From ), node ( interval.m_To + 1 ), 1, -interval.m_Payment );
+
+    // successive shortest paths, Bellman-Ford copes with the negative costs,
+    // nodes are visited in time order so the forward edges settle in a single round
+    int profit = 0;
+    dist.resize ( n );
+    pred.resize ( n );
+    for ( int flow = 0; flow < problem.m_Count; flow++ ) {
+        fill ( dist.begin(), dist.end(), INT_MAX );
+        dist[0] = 0;
+        for ( int round = 0; round < n; round++ ) {
+            bool changed = false;
+            for ( int u = 0; u < n; u++ ) {
+                if ( dist[u] == INT_MAX )
+                    continue;
+                for ( int e = head[u]; e != -1; e = edges[e].m_Next )
+                    if ( edges[e].m_Cap > 0 && dist[u] + edges[e].m_Cost < dist[edges[e].m_To] ) {
+                        dist[edges[e].m_To] = dist[u] + edges[e].m_Cost;
+                        pred[edges[e].m_To] = e;
+                        changed = true;
+                    }
+            }
+            if ( ! changed )
+                break;
+        }
+        // no path adds any profit, renting more items would not help
+        if ( dist[n - 1] >= 0 )
+            break;
+        profit -= dist[n - 1];
+        for ( int v = n - 1; v != 0; v = edges[pred[v] ^ 1].m_To ) {
+            edges[pred[v]].m_Cap--;
+            edges[pred[v] ^ 1].m_Cap++;
+        }
+    }
+    return profit;
+}
+
+/**
+ * Body of CNativeSolver::solveBatch, inlined into a function per instruction set. Everything is counted by comparing
+ * all pairs of intervals, branch-free across the lanes: the rank of an interval by its end, the intervals ending before
+ * it starts and the ones open at its start. Shorter problems are padded by intervals without a payment, they change
+ * neither the ranks of the others nor the results.
+ */
+static inline __attribute__ (( always_inline )) void solveLanes ( const AProblem * problems, size_t count ) {
+    constexpr size_t L = CNativeSolver::BATCH_LANES, N = CNativeSolver::BATCH_INTERVALS;
+    // the lanes of an interval are both a plain array and a vector
+    typedef int32_t TLanes __attribute__ (( vector_size ( 4 * L ), may_alias ));
+    alignas ( TLanes ) int32_t from[N][L], to[N][L], pay[N][L], rank[N][L], prev[N][L];
+    alignas ( TLanes ) int32_t payByEnd[N][L], prevByEnd[N][L], best[N + 1][L];
+    TLanes * vFrom = (TLanes *) from, * vTo = (TLanes *) to, * vPay = (TLanes *) pay;
+    TLanes * vPayByEnd = (TLanes *) payByEnd, * vBest = (TLanes *) best;
+    int32_t k[L] = {};  // count of the problem in the lane, zero if it is not solved in the lanes
+    size_t n = 0;
+    for ( size_t l = 0; l < count; l++ ) {
+        const CProblem & problem = *problems[l];
+        if ( problem.m_Count >= 1 && problem.m_Count <= 3 && problem.m_Intervals.size() <= N ) {
+            k[l] = problem.m_Count;
+            n = max ( n, problem.m_Intervals.size() );
+        }
+    }
+    for ( size_t l = 0; l < L; l++ ) {
+        size_t i = 0;
+        if ( l < count && k[l] )
+            for ( const auto & interval : problems[l]->m_Intervals ) {
+                from[i][l] = interval.m_From;
+                to[i][l] = interval.m_To;
+                pay[i++][l] = max ( 0, interval.m_Payment );
+            }
+        for ( ; i < n; i++ )
+            from[i][l] = to[i][l] = pay[i][l] = 0;
+    }
+
+    // comparisons give -1 in the lanes where they hold
+    TLanes maxDepth = {}, total = {};
+    for ( size_t i = 0; i < n; i++ ) {
+        TLanes r = {}, p = {}, depth = {};
+        for ( size_t j = 0; j < n; j++ ) {
+            r -= j < i ? vTo[j] <= vTo[i] : vTo[j] < vTo[i];
+            p -= vTo[j] < vFrom[i];
+            depth -= ( vFrom[j] <= vFrom[i] ) & ( vFrom[i] <= vTo[j] ) & ( vPay[j] > 0 );
+        }
+        *(TLanes *) rank[i] = r;
+        *(TLanes *) prev[i] = p;
+        depth &= vPay[i] > 0;
+        maxDepth ^= ( maxDepth ^ depth ) & ( depth > maxDepth );
+        total += vPay[i];
+    }
+
+    // weighted interval scheduling in the order of the ends, the intervals ending before one starts are a prefix
+    for ( size_t i = 0; i < n; i++ )
+        for ( size_t l = 0; l < L; l++ ) {
+            payByEnd[rank[i][l]][l] = pay[i][l];
+            prevByEnd[rank[i][l]][l] = prev[i][l];
+        }
+    vBest[0] = TLanes {};
+    for ( size_t i = 0; i < n; i++ ) {
+        alignas ( TLanes ) int32_t taken[L];
+        for ( size_t l = 0; l < L; l++ )
+            taken[l] = best[prevByEnd[i][l]][l];
+        TLanes t = *(TLanes *) taken + vPayByEnd[i];
+        vBest[i + 1] = vBest[i] ^ ( ( vBest[i] ^ t ) & ( t > vBest[i] ) );
+    }
+
+    for ( size_t l = 0; l < count; l++ ) {
+        CProblem & problem = *problems[l];
+        if ( k[l] == 1 )
+            problem.m_MaxProfit = best[n][l];
+        else if ( k[l] && maxDepth[l] <= k[l] )
+            problem.m_MaxProfit = total[l];
+        else
+            problem.m_MaxProfit = CNativeSolver::maxProfit ( problem );
+    }
+}
+
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+__attribute__ (( target ( "avx2" ) )) static void solveLanesAvx2 ( const AProblem * problems, size_t count ) {
+    solveLanes ( problems, count );
+}
+#endif /* __x86_64__ || __i386__ */
+
+static void solveLanesGeneric ( const AProblem * problems, size_t count ) {
+    solveLanes ( problems, count );
+}
+
+void CNativeSolver::solveBatch ( const AProblem * problems, size_t count ) {
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+    static const bool avx2 = __builtin_cpu_supports ( "avx2" );
+    if ( avx2 ) {
+        solveLanesAvx2 ( problems, count );
+        return;
+    }
+#endif /* __x86_64__ || __i386__ */
+    solveLanesGeneric ( problems, count );
+}
+
+size_t CNativeSolver::solve () {
+    if ( m_Solved )
+        return 0;
+    m_Solved = true;
+    if ( s_Batched )
+        for ( size_t i = 0; i < m_Problems.size(); i += BATCH_LANES )
+            solveBatch ( m_Problems.data() + i, min ( BATCH_LANES, m_Problems.size() - i ) );
+    else
+        for ( const auto & problem : m_Problems )
+            problem->m_MaxProfit = maxProfit ( *problem );
+    return m_Problems.size();
+}
+
+/**
+ * Progtest solver drawing its problems from a budget shared with other solvers, possibly in other processes.
+ * A slot of the budget is reserved ahead, so the solver has free capacity only if the next problem surely fits.
+ * The reserved slot is returned to the budget once the solver is solved or dropped.
+ */
+class CBudgetSolver : public CProgtestSolver {
 private:
-        AProgtestSolver m_Solver;
-        vector<AProblemWrapper> m_Problems;
+    AProgtestSolver m_Solver;
+    atomic<int64_t> & m_Budget;
+    bool m_Reserved = false;
+
+    void reserve () {
+        m_Reserved = m_Budget.fetch_sub ( 1, memory_order_relaxed ) > 0;
+        if ( ! m_Reserved )
+            m_Budget.fetch_add ( 1, memory_order_relaxed );
+    }
+    void unreserve () {
+        if ( m_Reserved )
+            m_Budget.fetch_add ( 1, memory_order_relaxed );
+        m_Reserved = false;
+    }
 public:
-    explicit CSolverWrapper ( AProgtestSolver s )
-    : m_Solver ( std::move ( s ) ) {}
+    CBudgetSolver ( AProgtestSolver solver, atomic<int64_t> & budget )
+    : m_Solver ( std::move ( solver ) ), m_Budget ( budget ) {
+        reserve();
+    }
+    CBudgetSolver ( const CBudgetSolver & ) = delete;
+    CBudgetSolver & operator = ( const CBudgetSolver & ) = delete;
+    ~CBudgetSolver () override { unreserve(); }
 
-    size_t solve () { return m_Solver->solve(); }
-    bool addProblem ( const AProblemWrapper& problem ) {
-        m_Problems.push_back ( problem );
-        return m_Solver->addProblem ( problem->m_Problem );
+    bool hasFreeCapacity () const override { return m_Reserved && m_Solver->hasFreeCapacity(); }
+    bool addProblem ( AProblem problem ) override {
+        if ( ! hasFreeCapacity() || ! m_Solver->addProblem ( std::move ( problem ) ) )
+            return false;
+        m_Reserved = false;
+        if ( m_Solver->hasFreeCapacity() )
+            reserve();
+        return true;
+    }
+    size_t solve () override {
+        unreserve();
+        return m_Solver->solve();
     }
-    bool hasFreeCapacity() {  return m_Solver->hasFreeCapacity(); }
 };
-using ASolverWrapper = shared_ptr<CSolverWrapper>;
 
-class CCompanyWrapper;
-using ACompanyWrapper = shared_ptr<CCompanyWrapper>;
+/**
+ * Bounded cache of solved problems keyed by their count and sorted intervals. A problem identical to one that is
+ * being solved waits for its result instead of taking a solver slot.
+ */
+class CResultCache {
+public:
+    /** A problem waiting for the result of an identical one in flight. */
+    struct TWaiter {
+        AProblem m_Problem;
+        AProblemPackWrapper m_Pack;
+    };
+    struct TEntry {
+        bool m_Done = false;
+        int m_MaxProfit = 0;
+        vector<TWaiter> m_Waiters;
+        const string * m_Key = nullptr;       // the key lives in the map node, its address is stable
+        list<const string *>::iterator m_Lru; // valid once done, in flight entries are never evicted
+    };
+    enum class ELookup { HIT, PENDING, MISS };
+
+    explicit CResultCache ( size_t capacity ) : m_Capacity ( capacity ) {}
+    /**
+     * Fills m_MaxProfit on a hit, queues the problem behind an identical one in flight or registers it as in flight.
+     * @param[out] entry where to complete() the result on a miss
+     */
+    ELookup lookup ( const AProblem & problem, const AProblemPackWrapper & pack, TEntry * & entry );
+    /**
+     * Stores the result of a missed problem, fills and finishes the problems coalesced with it.
+     */
+    void complete ( TEntry * entry, int maxProfit );
+
+    atomic_uint64_t m_Hits { 0 };
+    atomic_uint64_t m_Misses { 0 };
+    atomic_uint64_t m_Coalesced { 0 };    // waited for an identical problem in flight
+    atomic_uint64_t m_Evictions { 0 };
+private:
+    mutex m_Mtx;
+    size_t m_Capacity;                    // done entries kept at most
+    unordered_map<string, TEntry> m_Entries;
+    list<const string *> m_Lru;           // keys of the done entries, the most recently used first
+};
+
+CResultCache::ELookup CResultCache::lookup ( const AProblem & problem, const AProblemPackWrapper & pack, TEntry * & entry ) {
+    // the canonical form is built in buffers reused by the calling receiver
+    static thread_local vector<CInterval> intervals;
+    static thread_local string key;
+    intervals.assign ( problem->m_Intervals.begin(), problem->m_Intervals.end() );
+    sort ( intervals.begin(), intervals.end(), [] ( const CInterval & a, const CInterval & b ) {
+        return tie ( a.m_From, a.m_To, a.m_Payment ) < tie ( b.m_From, b.m_To, b.m_Payment );
+    } );
+    key.assign ( reinterpret_cast<const char *> ( &problem->m_Count ), sizeof ( problem->m_Count ) );
+    for ( const auto & interval : intervals )
+        for ( int field : { interval.m_From, interval.m_To, interval.m_Payment } )
+            key.append ( reinterpret_cast<const char *> ( &field ), sizeof ( field ) );
+
+    unique_lock<mutex> ul ( m_Mtx );
+    auto it = m_Entries.find ( key );
+    if ( it == m_Entries.end() ) {
+        m_Misses++;
+        it = m_Entries.emplace ( key, TEntry () ).first;
+        entry = &it->second;
+        entry->m_Key = &it->first;
+        return ELookup::MISS;
+    }
+    if ( ! it->second.m_Done ) {
+        m_Coalesced++;
+        it->second.m_Waiters.push_back ( { problem, pack } );
+        return ELookup::PENDING;
+    }
+    m_Hits++;
+    m_Lru.splice ( m_Lru.begin(), m_Lru, it->second.m_Lru );
+    problem->m_MaxProfit = it->second.m_MaxProfit;
+    return ELookup::HIT;
+}
+
+void CResultCache::complete ( TEntry * entry, int maxProfit ) {
+    // reused by the calling worker
+    static thread_local vector<TWaiter> waiters;
+    unique_lock<mutex> ul ( m_Mtx );
+    entry->m_Done = true;
+    entry->m_MaxProfit = maxProfit;
+    waiters.swap ( entry->m_Waiters );
+    m_Lru.push_front ( entry->m_Key );
+    entry->m_Lru = m_Lru.begin();
+    while ( m_Lru.size() > m_Capacity ) {
+        m_Entries.erase ( *m_Lru.back() );
+        m_Lru.pop_back();
+        m_Evictions++;
+    }
+    ul.unlock();
+    for ( auto & waiter : waiters ) {
+        waiter.m_Problem->m_MaxProfit = maxProfit;
+        waiter.m_Pack->finishProblems ( 1 );
+    }
+    waiters.clear();
+}
 
+/**
+ * A problem split into independent parts that are solved separately, the last solved part sums them up.
+ */
+struct TSplit {
+    AProblem m_Problem;
+    AProblemPackWrapper m_Pack;
+    CResultCache::TEntry * m_Entry;       // cache entry waiting for the result, nullptr if none
+    vector<AProblem> m_Parts;
+    int m_Base = 0;                       // profit of the parts summed up without a solver
+    atomic_size_t m_Unsolved { 0 };
+    /**
+     * Called once for every part when it is solved.
+     */
+    void partSolved ( CResultCache * cache ) {
+        if ( m_Unsolved.fetch_sub ( 1, memory_order_acq_rel ) != 1 )
+            return;
+        int profit = m_Base;
+        for ( const auto & part : m_Parts )
+            profit += part->m_MaxProfit;
+        m_Problem->m_MaxProfit = profit;
+        if ( m_Entry )
+            cache->complete ( m_Entry, profit );
+        m_Pack->finishProblems ( 1 );
+    }
+};
+using ASplit = shared_ptr<TSplit>;
+
+/**
+ * Deficit round-robin over per-company queues of problems waiting for a solver. Each time a company gets to
+ * the front, it may place quantum * weight problems. Guarded by the filling lock of the optimizer.
+ */
+class CFairScheduler {
+public:
+    struct TItem {
+        AProblemPackWrapper m_Pack;
+        const AProblem * m_Problem;             // owned by the pack, or by m_Split for its parts
+        CResultCache::TEntry * m_Entry;
+        ASplit m_Split;                         // the problem is a part of m_Split
+    };
+    explicit CFairScheduler ( size_t quantum ) : m_Quantum ( max ( size_t ( 1 ), quantum ) ) {}
+    /**
+     * Sets up the queue of a company, a new one or one freed by a finished company. A freed queue is empty.
+     */
+    void addLane ( size_t lane, size_t weight ) {
+        if ( lane == m_Lanes.size() )
+            m_Lanes.emplace_back();
+        m_Lanes[lane].m_Weight = max ( size_t ( 1 ), weight );
+        m_Lanes[lane].m_Deficit = 0;
+    }
+    void push ( size_t lane, TItem item ) {
+        TLane & l = m_Lanes[lane];
+        if ( l.m_Items.empty() )
+            m_Active.push_back ( lane );
+        l.m_Items.push_back ( std::move ( item ) );
+        m_Size.fetch_add ( 1, memory_order_relaxed );
+    }
+    /**
+     * Takes the next problem in the deficit round-robin order.
+     * @return false if no problem waits
+     */
+    bool pop ( TItem & item ) {
+        while ( ! m_Active.empty() ) {
+            size_t idx = m_Active.front();
+            TLane & l = m_Lanes[idx];
+            if ( ! m_FrontCharged ) {
+                l.m_Deficit += m_Quantum * l.m_Weight;
+                m_FrontCharged = true;
+            }
+            if ( l.m_Deficit == 0 ) {
+                // the turn is over, to the end of the line
+                m_Active.pop_front();
+                m_Active.push_back ( idx );
+                m_FrontCharged = false;
+                continue;
+            }
+            item = std::move ( l.m_Items.front() );
+            l.m_Items.pop_front();
+            l.m_Deficit--;
+            m_Size.fetch_sub ( 1, memory_order_relaxed );
+            if ( l.m_Items.empty() ) {
+                // an idle company does not save up its turns
+                l.m_Deficit = 0;
+                m_Active.pop_front();
+                m_FrontCharged = false;
+            }
+            return true;
+        }
+        return false;
+    }
+    /**
+     * @return number of waiting problems, may be read without the lock
+     */
+    size_t size () const { return m_Size.load ( memory_order_relaxed ); }
+private:
+    struct TLane {
+        CRing<TItem> m_Items;
+        size_t m_Weight = 1;
+        size_t m_Deficit = 0;
+    };
+    size_t m_Quantum;
+    deque<TLane> m_Lanes;                 // by company, deque keeps them in place when more are added
+    CRing<size_t> m_Active;               // lanes with waiting problems, in the round-robin order
+    bool m_FrontCharged = false;          // the front lane has received its quantum for the current turn
+    atomic_size_t m_Size { 0 };
+};
+
+class CSolverPool;
+
+/**
+ * A solver and the packs its problems belong to. Wrappers are recycled through CSolverPool,
+ * a native solver inside is reused with them.
+ */
+class CSolverWrapper{
+private:
+        /** Consecutive problems of the same pack. */
+        struct TPackRun {
+            AProblemPackWrapper m_Pack;
+            size_t m_Count;
+        };
+        AProgtestSolver m_Solver;
+        CNativeSolver * m_Native = nullptr; // m_Solver, if it is a native one
+        vector<TPackRun> m_Runs;
+        vector<pair<CResultCache::TEntry *, AProblem>> m_Cached; // results the cache waits for
+        vector<ASplit> m_Splits;                                 // of the parts in the batch
+        size_t m_Size = 0;
+        uint64_t m_Cost = 0;  // estimated cost of solving the batch
+        chrono::steady_clock::time_point m_FirstAdded; // valid once the solver holds a problem
+        atomic_uint32_t m_Refs { 0 };
+        CSolverPool & m_Pool;
+public:
+    explicit CSolverWrapper ( CSolverPool & pool )
+    : m_Pool ( pool ) {}
+
+    /**
+     * Sets the solver to fill, unless a reused native one is already in place.
+     */
+    void init ( const function<AProgtestSolver ()> & factory ) {
+        if ( m_Native )
+            return;
+        m_Solver = factory();
+        m_Native = dynamic_cast<CNativeSolver *> ( m_Solver.get() );
+    }
+    /**
+     * Forgets the solved batch, a progtest solver cannot be used again.
+     */
+    void reset () {
+        m_Runs.clear();
+        m_Cached.clear();
+        m_Splits.clear();
+        m_Size = 0;
+        m_Cost = 0;
+        if ( m_Native )
+            m_Native->reset();
+        else
+            m_Solver.reset();
+    }
+    void addRef () { m_Refs.fetch_add ( 1, memory_order_relaxed ); }
+    void release ();
+    /**
+     * Solves the batch and wakes the returners of the packs it completed.
+     * @param[in] cache where the entries of the problems added with one are published
+     */
+    size_t solve ( CResultCache * cache = nullptr );
+    /**
+     * @param[in] entry cache entry waiting for the result, nullptr if none
+     */
+    bool addProblem ( const AProblemPackWrapper & pack, const AProblem & problem, CResultCache::TEntry * entry = nullptr ) {
+        if ( entry )
+            m_Cached.emplace_back ( entry, problem );
+        if ( m_Size++ == 0 )
+            m_FirstAdded = chrono::steady_clock::now();
+        m_Cost += CNativeSolver::estimateCost ( *problem );
+        if ( ! m_Runs.empty() && m_Runs.back().m_Pack == pack )
+            m_Runs.back().m_Count++;
+        else
+            m_Runs.push_back ( { pack, 1 } );
+        return m_Solver->addProblem ( problem );
+    }
+    /**
+     * Adds a part of a split problem, the split is completed instead of a pack.
+     */
+    bool addPart ( const ASplit & split, const AProblem & part ) {
+        if ( m_Size++ == 0 )
+            m_FirstAdded = chrono::steady_clock::now();
+        m_Cost += CNativeSolver::estimateCost ( *part );
+        m_Splits.push_back ( split );
+        return m_Solver->addProblem ( part );
+    }
+    bool hasFreeCapacity() {  return m_Solver->hasFreeCapacity(); }
+    /**
+     * @return true if the last problem added is a part of split, the parts of a split are added one after another
+     */
+    bool holdsPartOf ( const ASplit & split ) const { return ! m_Splits.empty() && m_Splits.back() == split; }
+    size_t size () const { return m_Size; }
+    uint64_t cost () const { return m_Cost; }
+    chrono::steady_clock::time_point firstAdded () const { return m_FirstAdded; }
+};
+using ASolverWrapper = CRef<CSolverWrapper>;
+
+/**
+ * Free list of solver wrappers, filled by the workers when they are done with a solver.
+ */
+class CSolverPool {
+private:
+    mutex m_Mtx;
+    vector<CSolverWrapper *> m_Free;
+public:
+    CSolverPool () = default;
+    CSolverPool ( const CSolverPool & ) = delete;
+    CSolverPool & operator = ( const CSolverPool & ) = delete;
+    ~CSolverPool () {
+        for ( auto solver : m_Free )
+            delete solver;
+    }
+    ASolverWrapper acquire () {
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( m_Free.empty() ) {
+            ul.unlock();
+            return ASolverWrapper ( new CSolverWrapper ( *this ) );
+        }
+        CSolverWrapper * solver = m_Free.back();
+        m_Free.pop_back();
+        return ASolverWrapper ( solver );
+    }
+    void recycle ( CSolverWrapper * solver ) {
+        solver->reset();
+        unique_lock<mutex> ul ( m_Mtx );
+        m_Free.push_back ( solver );
+    }
+};
+
+/**
+ * Creates the next solver ahead of need outside of the filling lock, taking it is then a pointer swap.
+ * A single solver is kept ready, the library would not give out any more than it gave before.
+ */
+class CSolverProvider {
+private:
+    mutex m_Mtx;
+    ASolverWrapper m_Next;
+    bool m_Preparing = false;
+    atomic_bool m_Wanted { true };  // the ready solver was taken, or there was none
+public:
+    /**
+     * @return the ready solver, nullptr if there is none yet
+     */
+    ASolverWrapper take () {
+        m_Wanted.store ( true, memory_order_relaxed );
+        unique_lock<mutex> ul ( m_Mtx );
+        return std::move ( m_Next );
+    }
+    /**
+     * Creates the next solver if the last one was taken, cheap otherwise. Called without the filling lock.
+     */
+    void prepare ( CSolverPool & pool, const function<AProgtestSolver ()> & factory ) {
+        if ( ! m_Wanted.load ( memory_order_relaxed ) )
+            return;
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( m_Next || m_Preparing )
+            return;
+        m_Preparing = true;
+        m_Wanted.store ( false, memory_order_relaxed );
+        ul.unlock();
+        ASolverWrapper solver = pool.acquire();
+        {
+            CTraceSpan span ( "prepare solver" );
+            solver->init ( factory );
+        }
+        ul.lock();
+        m_Next = std::move ( solver );
+        m_Preparing = false;
+    }
+};
+
+void CSolverWrapper::release () {
+    if ( m_Refs.fetch_sub ( 1, memory_order_acq_rel ) == 1 )
+        m_Pool.recycle ( this );
+}
+
+class CCompanyWrapper;
+using ACompanyWrapper = shared_ptr<CCompanyWrapper>;
+
+
+class CSafePPackQueue {
+private:
+  CRing<AProblemPackWrapper> m_Queue;
+  mutex m_Mtx;                    // controls access to the shared queue and the free list
+  CSpinPark m_CVEmpty;            // protects from removing items from an empty queue
+  size_t m_MaxDepth = 0;
+  vector<CProblemPackWrapper *> m_Free; // recycled wrappers of this company
+  size_t m_Allocated = 0;               // wrappers ever created, the ones not in m_Free are still referenced
+  function<void ()> m_OnReady;          // replaces the returner wakeup when the company is multiplexed
+  bool m_Ended = false;                 // the returner is done with the company
+  condition_variable m_CVIdle;          // signalled once ended and the last wrapper is recycled
+
+public:
+    CSafePPackQueue () = default;
+    CSafePPackQueue ( const CSafePPackQueue & ) = delete;
+    CSafePPackQueue & operator = ( const CSafePPackQueue & ) = delete;
+    ~CSafePPackQueue () {
+        for ( auto pack : m_Free )
+            delete pack;
+    }
+    /**
+     * Wraps a pack, reusing a recycled wrapper if there is one, and appends it to the queue.
+     */
+    AProblemPackWrapper push ( AProblemPack pPack, CStats * stats ) {
+      unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+      CProblemPackWrapper * wrapper;
+      if ( m_Free.empty() ) {
+          wrapper = new CProblemPackWrapper ( *this );
+          m_Allocated++;
+      }
+      else {
+          wrapper = m_Free.back();
+          m_Free.pop_back();
+      }
+      wrapper->init ( std::move ( pPack ), stats );
+      AProblemPackWrapper item ( wrapper );
+      push ( ul, item );
+      return item;
+    }
+    /**
+     * Appends the end of input marker.
+     */
+    void pushEnd () {
+      unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+      push ( ul, nullptr );
+    }
+    /**
+    * Pop and return the item at the front.
+    */
+    AProblemPackWrapper pop () {
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        if ( ! readyLocked() ) {
+            CTraceSpan span ( "wait for solved pack" );
+            m_CVEmpty.wait ( ul, [ this ] {
+                // nullptr at front means all packs that were ever received were already solved
+                return readyLocked();
+            } );
+        }
+        AProblemPackWrapper item  = std::move ( m_Queue.front() );
+        m_Queue.pop_front();
+        return item;
+    }
+    /**
+     * Wakes the returner only if the solved pack is the one it is waiting for.
+     */
+    void notifySolved ( const CProblemPackWrapper * pack ) {
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        if ( ! m_Queue.empty() && m_Queue.front().get() == pack )
+            notifyReady();
+    }
+    /**
+     * Pops the item at the front if it is ready to be returned, never blocks.
+     * @return false if there is no such item
+     */
+    bool tryPop ( AProblemPackWrapper & item ) {
+        item = nullptr; // the last reference would be recycled into this queue, not under its lock
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        if ( ! readyLocked() )
+            return false;
+        item = std::move ( m_Queue.front() );
+        m_Queue.pop_front();
+        return true;
+    }
+    /**
+     * Calls onReady, under the queue lock, instead of waking pop() whenever the front becomes ready. Set before use.
+     */
+    bool frontReady () { unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" ); return readyLocked(); }
+    void setOnReady ( function<void ()> onReady ) { m_OnReady = std::move ( onReady ); }
+    void recycle ( CProblemPackWrapper * pack ) {
+        AProblemPack pPack = std::move ( pack->m_ProblemPack ); // released outside of the lock
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        m_Free.push_back ( pack );
+        if ( m_Ended && m_Free.size() == m_Allocated )
+            m_CVIdle.notify_all();
+    }
+    size_t size () { unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" ); return m_Queue.size(); }
+    /**
+     * @return true if the queue is empty and no pack wrapper is referenced any more, nothing touches the queue then
+     */
+    bool idle () {
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        return m_Queue.empty() && m_Free.size() == m_Allocated;
+    }
+    /**
+     * Called by the returner as the last thing it does with the company, after returning the end of input.
+     */
+    void ended () {
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        m_Ended = true;
+        if ( m_Free.size() == m_Allocated )
+            m_CVIdle.notify_all();
+    }
+    /**
+     * Blocks until the returner ended and no pack wrapper is referenced any more.
+     */
+    void waitIdle () {
+        unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" );
+        m_CVIdle.wait ( ul, [ this ] { return m_Ended && m_Free.size() == m_Allocated; } );
+    }
+    size_t maxDepth () { unique_lock<mutex> ul = lockTraced ( m_Mtx, "lock CSafePPackQueue::m_Mtx" ); return m_MaxDepth; }
+    const CSpinPark & waits () const { return m_CVEmpty; }
+private:
+    void push ( unique_lock<mutex> &, AProblemPackWrapper item ) {
+      bool ready = item == nullptr || item->isSolved();
+      m_Queue.push_back ( std::move ( item ) );
+      m_MaxDepth = max ( m_MaxDepth, m_Queue.size() );
+      // the returner only cares about a ready item at the front
+      if ( m_Queue.size() == 1 && ready )
+          notifyReady();
+    }
+    bool readyLocked () const {
+        return ! m_Queue.empty() && ( m_Queue.front() == nullptr || m_Queue.front()->isSolved() );
+    }
+    void notifyReady () {
+        if ( m_OnReady )
+            m_OnReady();
+        else
+            m_CVEmpty.notifyOne();
+    }
+};
+
+void CProblemPackWrapper::release () {
+    if ( m_Refs.fetch_sub ( 1, memory_order_acq_rel ) == 1 )
+        m_Owner.recycle ( this );
+}
+
+/**
+ * Chase-Lev work stealing deque of a fixed capacity. Only the owner pushes and takes, at the bottom,
+ * any thread may steal from the top.
+ */
+template <typename T>
+class CStealDeque {
+private:
+    static constexpr int64_t CAPACITY = 256;
+    alignas ( 64 ) atomic<int64_t> m_Top { 0 };
+    alignas ( 64 ) atomic<int64_t> m_Bottom { 0 };
+    array<atomic<T *>, CAPACITY> m_Items {};
+public:
+    /**
+     * @return false if the deque is full
+     */
+    bool push ( T * item ) {
+        int64_t b = m_Bottom.load ( memory_order_relaxed );
+        if ( b - m_Top.load ( memory_order_acquire ) >= CAPACITY )
+            return false;
+        m_Items[b & ( CAPACITY - 1 )].store ( item, memory_order_release );
+        m_Bottom.store ( b + 1, memory_order_release );
+        return true;
+    }
+    T * take () {
+        int64_t b = m_Bottom.load ( memory_order_relaxed ) - 1;
+        m_Bottom.store ( b, memory_order_seq_cst );
+        int64_t t = m_Top.load ( memory_order_seq_cst );
+        if ( t > b ) {
+            m_Bottom.store ( b + 1, memory_order_relaxed );
+            return nullptr;
+        }
+        T * item = m_Items[b & ( CAPACITY - 1 )].load ( memory_order_acquire );
+        if ( t == b ) {
+            // the last item, race the thieves for it
+            if ( ! m_Top.compare_exchange_strong ( t, t + 1, memory_order_seq_cst ) )
+                item = nullptr;
+            m_Bottom.store ( b + 1, memory_order_relaxed );
+        }
+        return item;
+    }
+    /**
+     * @return nullptr only if the deque was seen empty, a lost race is retried
+     */
+    T * steal () {
+        while ( true ) {
+            int64_t t = m_Top.load ( memory_order_seq_cst );
+            int64_t b = m_Bottom.load ( memory_order_seq_cst );
+            if ( t >= b )
+                return nullptr;
+            T * item = m_Items[t & ( CAPACITY - 1 )].load ( memory_order_acquire );
+            if ( m_Top.compare_exchange_strong ( t, t + 1, memory_order_seq_cst ) )
+                return item;
+        }
+    }
+    size_t size () const {
+        return size_t ( max ( int64_t ( 0 ), m_Bottom.load ( memory_order_relaxed ) - m_Top.load ( memory_order_relaxed ) ) );
+    }
+};
+
+/**
+ * Bounded lock-free multi producer multi consumer queue ( D. Vyukov ).
+ */
+template <typename T>
+class CInjectQueue {
+private:
+    struct TCell {
+        atomic_size_t m_Seq;
+        T * m_Item;
+    };
+    static constexpr size_t CAPACITY = 1 << 14;
+    unique_ptr<TCell[]> m_Cells;
+    alignas ( 64 ) atomic_size_t m_Enqueue { 0 };
+    alignas ( 64 ) atomic_size_t m_Dequeue { 0 };
+public:
+    CInjectQueue () : m_Cells ( new TCell[CAPACITY] ) {
+        for ( size_t i = 0; i < CAPACITY; i++ )
+            m_Cells[i].m_Seq.store ( i, memory_order_relaxed );
+    }
+    /**
+     * @return false if the queue is full
+     */
+    bool push ( T * item ) {
+        size_t pos = m_Enqueue.load ( memory_order_relaxed );
+        while ( true ) {
+            TCell & cell = m_Cells[pos & ( CAPACITY - 1 )];
+            intptr_t dif = intptr_t ( cell.m_Seq.load ( memory_order_acquire ) ) - intptr_t ( pos );
+            if ( dif == 0 ) {
+                if ( m_Enqueue.compare_exchange_weak ( pos, pos + 1, memory_order_relaxed ) ) {
+                    cell.m_Item = item;
+                    cell.m_Seq.store ( pos + 1, memory_order_release );
+                    return true;
+                }
+            }
+            else if ( dif < 0 )
+                return false;
+            else
+                pos = m_Enqueue.load ( memory_order_relaxed );
+        }
+    }
+    T * pop () {
+        size_t pos = m_Dequeue.load ( memory_order_relaxed );
+        while ( true ) {
+            TCell & cell = m_Cells[pos & ( CAPACITY - 1 )];
+            intptr_t dif = intptr_t ( cell.m_Seq.load ( memory_order_acquire ) ) - intptr_t ( pos + 1 );
+            if ( dif == 0 ) {
+                if ( m_Dequeue.compare_exchange_weak ( pos, pos + 1, memory_order_relaxed ) ) {
+                    T * item = cell.m_Item;
+                    cell.m_Seq.store ( pos + CAPACITY, memory_order_release );
+                    return item;
+                }
+            }
+            else if ( dif < 0 )
+                return nullptr;
+            else
+                pos = m_Dequeue.load ( memory_order_relaxed );
+        }
+    }
+    size_t size () const {
+        size_t e = m_Enqueue.load ( memory_order_relaxed ), d = m_Dequeue.load ( memory_order_relaxed );
+        return e > d ? e - d : 0;
+    }
+};
+
+/**
+ * Queue of solvers ready to be solved, independent of the lock used for filling them. With work stealing, every
+ * worker has a lock-free deque for the solvers it stashes itself, the others go through a lock-free shared queue,
+ * idle workers steal from the busy ones and the mutex is only used for parking.
+ */
+class CSafeSolverQueue {
+private:
+    CRing<ASolverWrapper> m_Queue;
+    vector<ASolverWrapper> m_Heap; // max heap by the estimated cost, used instead of m_Queue when m_LongestFirst is set
+    bool m_LongestFirst = false;
+    // work stealing mode
+    vector<unique_ptr<CStealDeque<CSolverWrapper>>> m_Deques; // by worker slot, empty when not stealing
+    unique_ptr<CInjectQueue<CSolverWrapper>> m_Inject;
+    atomic_size_t m_Overflow { 0 };  // solvers in m_Queue because m_Inject was full
+    vector<size_t> m_FreeSlots;      // guarded by m_Mtx
+    struct TSlot {
+        CSafeSolverQueue * m_Queue;
+        size_t m_Idx;
+    };
+    static inline thread_local TSlot t_Slot { nullptr, 0 }; // deque of the calling worker
+
+    mutex m_Mtx;
+    CSpinPark m_CVEmpty;
+    atomic_bool m_Closed { false }; // no more solvers will be pushed
+    atomic_size_t m_Waiting { 0 }; // workers blocked in pop
+    atomic_size_t m_MaxDepth { 0 };
+public:
+    /**
+     * @return number of queued solvers, including the pushed one
+     */
+    size_t push ( ASolverWrapper solver ) {
+        if ( ! m_Deques.empty() )
+            return pushStealing ( std::move ( solver ) );
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( m_LongestFirst ) {
+            m_Heap.push_back ( std::move ( solver ) );
+            push_heap ( m_Heap.begin(), m_Heap.end(), cheaper );
+        }
+        else
+            m_Queue.push_back ( std::move ( solver ) );
+        updateMaxDepth ( count() );
+        m_CVEmpty.notifyOne();
+        return count();
+    }
+    /**
+     * Pop a solver, waiting for one if necessary.
+     * @param[in] timeout longest wait, zero waits without a limit
+     * @return nullptr once the queue was closed and drained, or when the wait timed out ( closed() tells them apart )
+     */
+    ASolverWrapper pop ( chrono::microseconds timeout = chrono::microseconds::zero() ) {
+        if ( ! m_Deques.empty() )
+            return popStealing ( timeout );
+        unique_lock<mutex> ul ( m_Mtx );
+        auto ready = [ this ] { return count() || m_Closed; };
+        if ( ! ready() ) {
+            CTraceSpan span ( "wait for solver" );
+            m_Waiting++;
+            if ( timeout == chrono::microseconds::zero() )
+                m_CVEmpty.wait ( ul, ready );
+            else
+                m_CVEmpty.waitFor ( ul, timeout, ready );
+            m_Waiting--;
+        }
+        if ( ! count() )
+            return nullptr;
+        if ( m_LongestFirst ) {
+            pop_heap ( m_Heap.begin(), m_Heap.end(), cheaper );
+            ASolverWrapper item = std::move ( m_Heap.back() );
+            m_Heap.pop_back();
+            return item;
+        }
+        ASolverWrapper item = std::move ( m_Queue.front() );
+        m_Queue.pop_front();
+        return item;
+    }
+    /**
+     * Hands out the most expensive solvers first instead of the oldest ones, set before use.
+     */
+    void setLongestFirst ( bool longestFirst ) { m_LongestFirst = longestFirst; }
+    /**
+     * Switches to work stealing, set before use. The longest first order takes precedence, it needs a single queue.
+     * @param[in] maxWorkers workers attached at the same time at most
+     */
+    void setWorkStealing ( size_t maxWorkers ) {
+        if ( m_LongestFirst )
+            return;
+        m_Inject = make_unique<CInjectQueue<CSolverWrapper>> ();
+        for ( size_t i = 0; i < maxWorkers; i++ ) {
+            m_Deques.push_back ( make_unique<CStealDeque<CSolverWrapper>> () );
+            m_FreeSlots.push_back ( maxWorkers - 1 - i );
+        }
+    }
+    /**
+     * Gives the calling worker its own deque, if stealing. A worker started while a retired one has not
+     * detached yet may find none, it then stashes through the shared queue.
+     */
+    void attachWorker () {
+        if ( m_Deques.empty() )
+            return;
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( m_FreeSlots.empty() )
+            return;
+        t_Slot = { this, m_FreeSlots.back() };
+        m_FreeSlots.pop_back();
+    }
+    /**
+     * Returns the deque of the calling worker, solvers left in it get stolen by the others.
+     */
+    void detachWorker () {
+        if ( t_Slot.m_Queue != this )
+            return;
+        unique_lock<mutex> ul ( m_Mtx );
+        m_FreeSlots.push_back ( t_Slot.m_Idx );
+        t_Slot = { nullptr, 0 };
+    }
+    void close () {
+        unique_lock<mutex> ul ( m_Mtx );
+        m_Closed = true;
+        m_CVEmpty.notifyAll();
+    }
+    bool closed () { unique_lock<mutex> ul ( m_Mtx ); return m_Closed && ! count(); }
+    size_t waiting () const { return m_Waiting.load(); }
+    size_t size () {
+        if ( ! m_Deques.empty() )
+            return countStealing();
+        unique_lock<mutex> ul ( m_Mtx );
+        return count();
+    }
+    size_t maxDepth () const { return m_MaxDepth.load(); }
+    const CSpinPark & waits () const { return m_CVEmpty; }
+private:
+    size_t count () const {
+        return m_Deques.empty() ? m_Queue.size() + m_Heap.size() : countStealing();
+    }
+    size_t countStealing () const {
+        size_t cnt = m_Inject->size() + m_Overflow.load();
+        for ( const auto & deque : m_Deques )
+            cnt += deque->size();
+        return cnt;
+    }
+    void updateMaxDepth ( size_t depth ) {
+        size_t max = m_MaxDepth.load ( memory_order_relaxed );
+        while ( depth > max && ! m_MaxDepth.compare_exchange_weak ( max, depth, memory_order_relaxed ) )
+            ;
+    }
+    static bool cheaper ( const ASolverWrapper & a, const ASolverWrapper & b ) { return a->cost() < b->cost(); }
+
+    size_t pushStealing ( ASolverWrapper solver ) {
+        CSolverWrapper * item = solver.detach();
+        bool own = t_Slot.m_Queue == this && m_Deques[t_Slot.m_Idx]->push ( item );
+        if ( ! own && ! m_Inject->push ( item ) ) {
+            unique_lock<mutex> ul ( m_Mtx );
+            m_Queue.push_back ( ASolverWrapper::adopt ( item ) );
+            m_Overflow++;
+        }
+        // a read-modify-write, ordered against the increment of a parking worker: either it is seen here,
+        // or the worker sees the push
+        if ( m_Waiting.fetch_add ( 0 ) ) {
+            unique_lock<mutex> ul ( m_Mtx );
+            m_CVEmpty.notifyOne();
+        }
+        size_t depth = countStealing();
+        updateMaxDepth ( depth );
+        return depth;
+    }
+    /**
+     * Takes a solver from the own deque, the shared queue, the other deques and the overflow, in this order.
+     * @param[in] locked the caller holds m_Mtx
+     */
+    CSolverWrapper * grab ( bool locked ) {
+        if ( t_Slot.m_Queue == this )
+            if ( CSolverWrapper * item = m_Deques[t_Slot.m_Idx]->take() )
+                return item;
+        if ( CSolverWrapper * item = m_Inject->pop() )
+            return item;
+        size_t start = t_Slot.m_Queue == this ? t_Slot.m_Idx + 1 : 0;
+        for ( size_t i = 0; i < m_Deques.size(); i++ )
+            if ( CSolverWrapper * item = m_Deques[( start + i ) % m_Deques.size()]->steal() )
+                return item;
+        if ( m_Overflow.load() ) {
+            unique_lock<mutex> ul ( m_Mtx, defer_lock );
+            if ( ! locked )
+                ul.lock();
+            if ( ! m_Queue.empty() ) {
+                m_Overflow--;
+                CSolverWrapper * item = m_Queue.front().detach();
+                m_Queue.pop_front();
+                return item;
+            }
+        }
+        return nullptr;
+    }
+    ASolverWrapper popStealing ( chrono::microseconds timeout ) {
+        if ( CSolverWrapper * item = grab ( false ) )
+            return ASolverWrapper::adopt ( item );
+        // the pushes notify under the lock, they cannot slip in between the last look and the wait
+        unique_lock<mutex> ul ( m_Mtx );
+        CTraceSpan span ( "wait for solver" );
+        m_Waiting++;
+        auto deadline = timeout == chrono::microseconds::zero() ? chrono::steady_clock::time_point::max()
+                                                                : chrono::steady_clock::now() + timeout;
+        CSolverWrapper * item = nullptr;
+        while ( true ) {
+            item = grab ( true );
+            if ( item || m_Closed )
+                break;
+            if ( ! m_CVEmpty.waitUntil ( ul, deadline ) ) {
+                item = grab ( true );
+                break;
+            }
+        }
+        m_Waiting--;
+        return ASolverWrapper::adopt ( item );
+    }
+};
+
+/**
+ * When to hand a partially filled solver to the workers. All disabled by default, solvers then wait until full.
+ */
+struct TFlushPolicy {
+    chrono::microseconds m_MaxWait { 0 }; // flush once the oldest problem of the solver waits this long, zero = never
+    bool m_FlushWhenIdle = false;         // flush whenever a worker waits for work
+    /**
+     * Progtest solver capacity the early flushes may leave unused in total ( M - N, if known ). Capacity of a partially
+     * filled solver is unknown, its unused part is charged as m_MaxCapacity less the problems in it. Native solvers
+     * have no budget and are flushed regardless.
+     */
+    size_t m_SpareCapacity = 0;
+    size_t m_MaxCapacity = 0;             // largest capacity a progtest solver may have, zero = unknown, no early flushes
+
+};
+
+/**
+ * Bounds of the worker pool. It grows while full solvers pile up and shrinks while workers stay idle.
+ */
+struct TPoolPolicy {
+    size_t m_MinWorkers = 1;
+    size_t m_MaxWorkers = 1;
+    size_t m_GrowBacklog = 2;                    // start a worker once more solvers than this wait per running worker
+    chrono::milliseconds m_IdleTimeout { 100 };  // a worker above the minimum exits after being idle this long
+    bool m_PinWorkers = false;                   // pin the workers to CPUs round-robin ( linux only )
+    size_t m_IoThreads = 0;                      // receiving and returning threads shared by all the companies,
+                                                 // zero = a receiver and a returner per company
+};
+
+/**
+ * Fixed set of threads serving the companies scheduled to it, each company by one thread at a time.
+ */
+class CIoPool {
+private:
+    mutex m_Mtx;
+    condition_variable m_CVReady;
+    CRing<CCompanyWrapper *> m_Ready;
+    size_t m_Active = 0;              // companies the handler has not finished yet
+    vector<thread> m_Threads;
+public:
+    /**
+     * @param[in] handler serves a scheduled company, returns true once the company is done with for good
+     * @param[in] threadName of the threads in the trace
+     */
+    void start ( size_t threadCount, size_t companyCount, const function<bool ( CCompanyWrapper * )> & handler,
+                 const char * threadName ) {
+        m_Active = companyCount;
+        for ( size_t i = 0; i < threadCount; i++ )
+            m_Threads.emplace_back ( [ this, handler, threadName ] {
+                CTracer::threadName ( threadName );
+                while ( CCompanyWrapper * company = next() )
+                    if ( handler ( company ) )
+                        done();
+            } );
+    }
+    void schedule ( CCompanyWrapper * company ) {
+        unique_lock<mutex> ul ( m_Mtx );
+        m_Ready.push_back ( company );
+        m_CVReady.notify_one();
+    }
+    /**
+     * Counts one more company to wait for, the threads run until each of them is done().
+     */
+    void attach () {
+        unique_lock<mutex> ul ( m_Mtx );
+        m_Active++;
+    }
+    /**
+     * Called once for each company the pool waited for, the threads exit after the last one.
+     */
+    void done () {
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( --m_Active == 0 )
+            m_CVReady.notify_all();
+    }
+    void join () {
+        for ( auto & thr : m_Threads )
+            thr.join();
+        m_Threads.clear();
+    }
+    bool running () const { return ! m_Threads.empty(); }
+private:
+    /**
+     * @return the next scheduled company, nullptr once all of them are done
+     */
+    CCompanyWrapper * next () {
+        unique_lock<mutex> ul ( m_Mtx );
+        if ( m_Ready.empty() && m_Active ) {
+            CTraceSpan span ( "wait for company" );
+            m_CVReady.wait ( ul, [ this ] { return ! m_Ready.empty() || m_Active == 0; } );
+        }
+        if ( m_Ready.empty() )
+            return nullptr;
+        CCompanyWrapper * company = m_Ready.front();
+        m_Ready.pop_front();
+        return company;
+    }
+};
+
+size_t CSolverWrapper::solve ( CResultCache * cache ) {
+    CTraceSpan span ( "solve" );
+    size_t solved = m_Solver->solve();
+    for ( const auto & [ entry, problem ] : m_Cached )
+        cache->complete ( entry, problem->m_MaxProfit );
+    for ( const auto & split : m_Splits )
+        split->partSolved ( cache );
+    for ( const auto & run : m_Runs )
+        run.m_Pack->finishProblems ( run.m_Count );
+    return solved;
+}
+
+/**
+ * Limits of the packs received and not returned yet, zero = unlimited.
+ */
+struct TFlowLimits {
+    size_t m_Packs = 0;
+    size_t m_Problems = 0;
+    size_t m_Bytes = 0;      // approximate, see CFlowControl::packBytes
+};
+
+/**
+ * Backpressure on the receiving. A company takes no more packs while it, or all the companies together, are over
+ * the limits, so each of them overshoots by the last pack it took at most.
+ */
+class CFlowControl {
+public:
+    /** In-flight packs of a company, guarded by the flow control. */
+    struct TUsage {
+        size_t m_Packs = 0;
+        size_t m_Problems = 0;
+        size_t m_Bytes = 0;
+        uint64_t m_ThrottledAt = 0;  // since when the company waits, in ns
+        bool m_Parked = false;
+    };
+
+    CFlowControl ( const TFlowLimits & company, const TFlowLimits & total )
+    : m_CompanyLimits ( company ), m_TotalLimits ( total ) {}
+    /**
+     * @return approximate memory taken by a pack and its problems
+     */
+    static size_t packBytes ( const CProblemPack & pack ) {
+        size_t bytes = sizeof ( CProblemPack ) + pack.m_Problems.capacity() * sizeof ( AProblem );
+        for ( const auto & problem : pack.m_Problems )
+            bytes += sizeof ( CProblem ) + problem->m_Intervals.capacity() * sizeof ( CInterval );
+        return bytes;
+    }
+    /**
+     * Counts a received pack in.
+     */
+    void acquire ( TUsage & usage, size_t problems, size_t bytes ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        for ( TUsage * u : { &usage, &m_Total } ) {
+            u->m_Packs++;
+            u->m_Problems += problems;
+            u->m_Bytes += bytes;
+        }
+    }
+    /**
+     * Counts a returned pack out, wakes the blocked receivers.
+     * @param[out] resumed gets the parked companies that may receive again
+     */
+    void release ( TUsage & usage, size_t problems, size_t bytes, vector<CCompanyWrapper *> & resumed ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        for ( TUsage * u : { &usage, &m_Total } ) {
+            u->m_Packs--;
+            u->m_Problems -= problems;
+            u->m_Bytes -= bytes;
+        }
+        if ( m_Throttled.load ( memory_order_relaxed ) == 0 )
+            return;
+        for ( size_t i = 0; i < m_Parked.size(); )
+            if ( ! over ( *m_Parked[i].second ) ) {
+                resume ( *m_Parked[i].second );
+                resumed.push_back ( m_Parked[i].first );
+                m_Parked[i] = m_Parked.back();
+                m_Parked.pop_back();
+            }
+            else
+                i++;
+        m_CVFree.notify_all();
+    }
+    /**
+     * Marks a receiver as blocked if the company may not take a pack now, wait() for it then.
+     * @return false if the company may go on
+     */
+    bool block ( TUsage & usage ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        if ( ! limitHit ( usage ) )
+            return false;
+        m_Throttled++;
+        return true;
+    }
+    /**
+     * Waits until the blocked receiver may take a pack, or until it is cancelled.
+     */
+    void wait ( TUsage & usage, const atomic_bool & cancel ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        m_CVFree.wait ( lk, [ & ] { return ! over ( usage ) || cancel.load(); } );
+        resume ( usage );
+    }
+    /**
+     * The non-blocking block(), a company multiplexed on the I/O threads is parked until release() resumes it.
+     * @return false if the company may go on
+     */
+    bool park ( TUsage & usage, CCompanyWrapper * company ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        if ( ! limitHit ( usage ) )
+            return false;
+        m_Throttled++;
+        usage.m_Parked = true;
+        m_Parked.emplace_back ( company, &usage );
+        return true;
+    }
+    /**
+     * Resumes a parked company regardless of the limits, wakes the blocked receivers to check their cancellation.
+     * @return true if the company was parked
+     */
+    bool unpark ( TUsage & usage ) {
+        unique_lock<mutex> lk ( m_Mtx );
+        m_CVFree.notify_all();
+        if ( ! usage.m_Parked )
+            return false;
+        for ( auto & parked : m_Parked )
+            if ( parked.second == &usage ) {
+                parked = m_Parked.back();
+                m_Parked.pop_back();
+                break;
+            }
+        resume ( usage );
+        return true;
+    }
+    /**
+     * @return receivers waiting for the in-flight packs to be returned
+     */
+    size_t throttled () const { return m_Throttled.load(); }
+    /**
+     * @return the in-flight packs of all the companies
+     */
+    TUsage total () { unique_lock<mutex> lk ( m_Mtx ); return m_Total; }
 
-class CSafePPackQueue {
+    atomic_uint64_t m_CompanyLimitHits { 0 }; // a company was stopped by its own limits
+    atomic_uint64_t m_TotalLimitHits { 0 };   // a company was stopped by the overall limits
+    atomic_uint64_t m_ThrottledNs { 0 };      // time the companies spent stopped, in total
 private:
-  deque<AProblemPackWrapper> m_Queue;
-  mutex m_Mtx;                    // controls access to the shared queue
-  condition_variable m_CVEmpty;   // protects from removing items from an empty queue
-
-public:
-    void push ( AProblemPackWrapper & item ) {
-      unique_lock<mutex> ul ( m_Mtx );
-      m_Queue.push_back ( item );
-      m_CVEmpty.notify_all();
+    static bool over ( const TFlowLimits & limits, const TUsage & usage ) {
+        return ( limits.m_Packs && usage.m_Packs >= limits.m_Packs )
+            || ( limits.m_Problems && usage.m_Problems >= limits.m_Problems )
+            || ( limits.m_Bytes && usage.m_Bytes >= limits.m_Bytes );
     }
+    bool over ( const TUsage & usage ) const { return over ( m_CompanyLimits, usage ) || over ( m_TotalLimits, m_Total ); }
     /**
-    * Pop and return the item at the front.
-    */
-    auto pop () {
-        unique_lock<mutex> ul ( m_Mtx );
-        m_CVEmpty.wait ( ul, [ this ] {
-            // nullptr at front means all packs that were ever received were already solved
-            return ( ! m_Queue.empty() && m_Queue.front() == nullptr )
-                   || ( ! m_Queue.empty() && m_Queue.front()->isSolved() );
-        } );
-        AProblemPackWrapper item  = m_Queue.front();
-        m_Queue.pop_front();
-        return item;
+     * Counts the hit if the company is over the limits, starts its throttled time then. Under the lock.
+     */
+    bool limitHit ( TUsage & usage ) {
+        if ( over ( m_CompanyLimits, usage ) )
+            m_CompanyLimitHits++;
+        else if ( over ( m_TotalLimits, m_Total ) )
+            m_TotalLimitHits++;
+        else
+            return false;
+        usage.m_ThrottledAt = nowNs();
+        return true;
     }
-    void notify() { unique_lock<mutex> ul ( m_Mtx ); m_CVEmpty.notify_all(); }
+    /** Under the lock. */
+    void resume ( TUsage & usage ) {
+        m_Throttled--;
+        usage.m_Parked = false;
+        m_ThrottledNs += nowNs() - usage.m_ThrottledAt;
+    }
+
+    mutex m_Mtx;
+    condition_variable m_CVFree;
+    TFlowLimits m_CompanyLimits;
+    TFlowLimits m_TotalLimits;
+    TUsage m_Total;
+    vector<pair<CCompanyWrapper *, TUsage *>> m_Parked;
+    atomic_size_t m_Throttled { 0 };
 };
 
+void CProblemPackWrapper::finishProblems ( size_t count ) {
+    if ( ! problemsSolved ( count ) )
+        return;
+    if ( m_Stats ) {
+        uint64_t now = nowNs();
+        m_Solved.store ( now, memory_order_relaxed );
+        m_Stats->m_SolveWait.add ( now - m_Placed.load ( memory_order_relaxed ) );
+    }
+    m_Owner.notifySolved ( this );
+}
+
 class COptimizer {
 public:
-    COptimizer ()
-    : m_Solver ( make_shared<CSolverWrapper> ( createProgtestSolver() ) ), m_FinishedReceivingCompaniesCnt ( 0 ), m_KillWorkers ( false ) {}
+    explicit COptimizer ( TFlushPolicy flushPolicy = TFlushPolicy () )
+    : m_Receiving ( 0 ),
+      m_FlushPolicy ( flushPolicy ), m_SpareCapacity ( flushPolicy.m_SpareCapacity ) {}
+
+    static bool usingProgtestSolver() { return ! s_NativeSolver; }
+    static void checkAlgorithm(AProblem problem) { problem->m_MaxProfit = CNativeSolver::maxProfit ( *problem ); }
+    /**
+     * Creates a progtest solver, or a native one when s_NativeSolver is set. A progtest solver that is null or has
+     * no capacity is replaced by a native one, nothing could be added to it. So is the progtest solver once
+     * s_SharedBudget runs out.
+     * @param[in] stats counts the replaced solvers, may be nullptr
+     */
+    static AProgtestSolver createSolver ( CStats * stats = nullptr );
 
-    static bool usingProgtestSolver() { return true; }
-    static void checkAlgorithm(AProblem problem) {}
+    static inline bool s_NativeSolver = false;           // mode switch, set before constructing the optimizer
+    static inline atomic<int64_t> * s_SharedBudget = nullptr;  // problems left to the progtest solvers of all the processes
+    static constexpr size_t NATIVE_SOLVER_CAPACITY = 8;  // batch size of native solvers, they have no global budget
 
+    /**
+     * Starts with a fixed pool of threadCount workers.
+     */
     void start(int threadCount);
+    /**
+     * Starts with an elastic pool of workers, m_MinWorkers of them right away.
+     */
+    void start ( const TPoolPolicy & pool );
 
     void stop ();
+    /**
+     * Turns on the pipeline statistics, call before start().
+     * @param[in] dumpAtStop print them to stderr at the end of stop()
+     */
+    void enableStats ( bool dumpAtStop = true ) { m_Stats = make_unique<CStats> (); m_DumpStats = dumpAtStop; }
+    /**
+     * @return statistics, nullptr if not enabled. Counters can be read while the optimizer runs.
+     */
+    CStats * stats () const { return m_Stats.get(); }
+    /**
+     * Turns on the result cache, call before start().
+     * @param[in] capacity solved problems kept at most
+     */
+    void enableCache ( size_t capacity ) { m_Cache = make_unique<CResultCache> ( capacity ); }
+    /**
+     * @return the result cache, nullptr if not enabled
+     */
+    CResultCache * cache () const { return m_Cache.get(); }
+    /**
+     * Turns on the weighted fair scheduling of the companies' problems into solvers, call before start().
+     * Full solvers are then queued only a little beyond what the workers can take ( m_GrowBacklog + 1 per worker ),
+     * the rest of the problems wait in per company queues served by deficit round-robin.
+     * @param[in] quantum problems a company of weight 1 may place per turn
+     */
+    void enableFairness ( size_t quantum = 8 ) { m_Fair = make_unique<CFairScheduler> ( quantum ); }
+    /**
+     * Workers take the full solver with the highest estimated cost first instead of the oldest one, which keeps
+     * a heavy batch from being the last one solved. Call before start().
+     */
+    void enableLongestFirst () { m_FullSolvers.setLongestFirst ( true ); }
+    /**
+     * Workers get lock-free deques and steal from each other instead of sharing one locked queue.
+     * Call before start(), ignored together with enableLongestFirst().
+     */
+    void enableWorkStealing () { m_WorkStealing = true; }
+    /**
+     * Splits the problems of at least minIntervals intervals into independent parts solved in parallel,
+     * native solvers only. Call before start().
+     */
+    void enableSplitting ( size_t minIntervals = 32 ) { m_SplitMin = minIntervals; }
+    /**
+     * Records a timeline of the threads from start() on and writes it to fileName at the end of stop(), in the Chrome
+     * trace format ( chrome://tracing, ui.perfetto.dev ). Only one optimizer may be traced at a time.
+     */
+    void enableTrace ( const string & fileName ) { m_Tracer = make_unique<CTracer> (); m_TraceFile = fileName; }
+    /**
+     * Keeps the optimizer running after all of its companies finished, until stop() drains it. Companies may then
+     * be added and removed while it runs, sharing the workers. Call before start().
+     */
+    void enableService () { m_Service = true; m_Draining = false; }
+    /**
+     * Bounds the packs received and not returned yet, a company stops receiving while over the limits.
+     * Call before start().
+     * @param[in] company limits of each company
+     * @param[in] total limits of all the companies together
+     */
+    void enableBackpressure ( const TFlowLimits & company, const TFlowLimits & total = TFlowLimits () ) {
+        m_Flow = make_unique<CFlowControl> ( company, total );
+    }
+    /**
+     * @return the flow control with its limit hit counters, nullptr if not enabled
+     */
+    CFlowControl * flowControl () const { return m_Flow.get(); }
+    /**
+     * Prints the statistics gathered so far, including the current queue depths.
+     */
+    void dumpStats ( ostream & os );
 
-    void addCompany ( const ACompany& company );
+    /**
+     * Adds a company, after start() only in the service mode. The companies that finished in the meantime are
+     * released then.
+     * @param[in] weight share of the solver slots under fair scheduling
+     */
+    void addCompany ( const ACompany& company, size_t weight = 1 );
+    /**
+     * Stops receiving from a company and returns once all of its received packs were solved and returned.
+     * A pending waitForPack of the company is waited for, the pack it delivers is still solved.
+     * @return false if the company is not in the optimizer
+     */
+    bool removeCompany ( const ACompany & company );
 
     void worker ();
     /**
-    * Constructs a new empty solver.
-    */
-    bool getNewSolver ();
+     * Starts a new worker, unless the pool is at its maximum size.
+     */
+    void spawnWorker ();
+    /**
+     * Lets the calling idle worker exit, unless the pool is at its minimum size.
+     */
+    bool retireWorker () {
+        size_t cnt = m_WorkerCnt.load();
+        while ( cnt > m_Pool.m_MinWorkers )
+            if ( m_WorkerCnt.compare_exchange_weak ( cnt, cnt - 1 ) ) {
+                if ( m_Stats )
+                    m_Stats->m_WorkersRetired++;
+                return true;
+            }
+        return false;
+    }
+    /**
+     * @return a new empty solver, the prepared one if there is one. Under the filling lock.
+     */
+    ASolverWrapper takeSolver ();
+    /**
+     * Prepares the next solver if the last one was taken. Called after releasing the filling lock.
+     */
+    void provideSolver () { m_Provider.prepare ( m_SolverPool, [ this ] { return createSolver ( m_Stats.get() ); } ); }
+    /**
+     * Adds the problems of a pack to the shared solver, replacing it whenever it gets full. With fair scheduling,
+     * they are queued for the company and only as many solvers are filled as the workers can take.
+     * Takes the filling lock once per pack, filled solvers are handed to the workers after it is released.
+     * @param[in] lane index of the company
+     */
+    void addProblems ( const AProblemPackWrapper & pack, size_t lane );
+    /** A problem or a part of a split one on its way into a solver. */
+    struct TPlacement {
+        const AProblem * m_Problem;
+        CResultCache::TEntry * m_Entry;
+        ASplit m_Split;
+    };
+    enum class ESplit { NONE, SOLVED, PARTS };
+    /**
+     * Splits a large problem into independent parts.
+     * @param[out] placements gets the parts to be solved
+     * @return NONE if the problem does not split, SOLVED if the split solved it right away
+     */
+    ESplit splitProblem ( const AProblemPackWrapper & pack, const AProblem & problem,
+                        CResultCache::TEntry * entry, vector<TPlacement> & placements );
+    /**
+     * Adds a problem to the shared solver, moves the solver to full once it gets full. Under the filling lock.
+     */
+    void placeProblem ( const AProblemPackWrapper & pack, const AProblem & problem,
+                        CResultCache::TEntry * entry, const ASplit & split, vector<ASolverWrapper> & full );
+    /**
+     * Timestamps the pack once all its problems are in solvers, in the fair mode that is after the scheduler
+     * let them in. Under the filling lock, with statistics enabled.
+     */
+    void packPlaced ( CProblemPackWrapper & pack );
+    /**
+     * Places the problems queued by the fair scheduler until budget solvers get full. Under the filling lock.
+     */
+    void fillFair ( vector<ASolverWrapper> & full, size_t budget );
+    /**
+     * @return how many more full solvers the workers could use right away, at least one
+     */
+    size_t fairBudget ();
+    /**
+     * Called by the workers as they take solvers, keeps the solver queue supplied from the fair scheduler.
+     */
+    void refillFair ();
     /**
      * Enqueues a solver and notifies worker.
      */
-    void stashSolver ();
-    bool allCompaniesFinishedReceiving () { return m_FinishedReceivingCompaniesCnt.load() == m_Companies.size(); }
-    void notifyCompanies();
-
+    void stashSolver ( ASolverWrapper solver );
+    /**
+     * Stashes the partially filled solver if the flush policy and the remaining spare capacity allow it.
+     * @param[in] idle the flush was triggered by an idle worker, not by the age of the solver
+     * @return true if a solver was flushed
+     */
+    bool flushSolver ( bool idle );
+    /**
+     * Called once by each receiver, the last one stashes the remaining solver. In the service mode, the others
+     * stash it as well, the companies still receiving may never fill it.
+     */
+    void companyFinishedReceiving ();
+    /**
+     * Stashes the remaining solver when no company is receiving, closes the solver queue if draining as well.
+     */
+    void receiversIdle ();
+    /**
+     * Called by a receiver stopped by the backpressure, the problems already placed must not wait for more.
+     */
+    void receiverThrottled ();
 
-    mutex m_MtxSolver;
-    ASolverWrapper m_Solver;
-    queue<ASolverWrapper> m_FullSolvers;
-    condition_variable m_CVWorker;
-    atomic_size_t m_FinishedReceivingCompaniesCnt;
-    vector<thread> m_Workers;
-    bool m_KillWorkers; // worker kill flag when all companies finished receiving problems
+    CSolverPool m_SolverPool;         // declared first, the solvers go back to it until the end
+    CSolverProvider m_Provider;
+    mutex m_MtxSolver;                // guards m_Solver, m_Closed, m_SpareCapacity and m_LargestCapacity
+    ASolverWrapper m_Solver;          // being filled, created with the first problem placed into it
+    bool m_Closed = false;            // the last solver was stashed
+    CSafeSolverQueue m_FullSolvers;
+    atomic_size_t m_Receiving;         // companies started and not finished receiving yet
 private:
+    /**
+     * Joins and releases the companies that are done. Under m_MtxCompanies.
+     */
+    void reapCompanies ();
+    /**
+     * Charges the unused capacity of the partially filled progtest solver to the spare capacity. Under the filling lock.
+     * @return false if the spare capacity does not cover it, nothing is charged then
+     */
+    bool chargeSpare ();
+    /**
+     * Moves the partially filled solver to full, charged to the spare capacity. The packs in it would never be
+     * returned otherwise, so it goes even beyond the spare capacity, that is counted in the statistics. Under
+     * the filling lock.
+     */
+    void forceSolver ( vector<ASolverWrapper> & full );
+    /**
+     * Forces the partially filled solver out while receivers are throttled and no fair queued problem could
+     * fill it. Under the filling lock.
+     */
+    void flushThrottled ( vector<ASolverWrapper> & full );
+    /**
+     * Places all the problems queued by the fair scheduler and forces the partially filled solver out, once
+     * a company stopped receiving while others go on.
+     */
+    void flushFinished ();
+
+    TPoolPolicy m_Pool;
+    mutex m_MtxWorkers;               // guards m_Workers and m_ExitedWorkers
+    list<thread> m_Workers;
+    vector<thread::id> m_ExitedWorkers; // retired workers, joined by the next spawnWorker or by stop
+    atomic_size_t m_WorkerCnt { 0 };  // running workers
+    size_t m_WorkerSeq = 0;           // workers ever started, for CPU pinning
+    TFlushPolicy m_FlushPolicy;
+    size_t m_SpareCapacity;           // what is left of m_FlushPolicy.m_SpareCapacity
+    size_t m_LargestCapacity = 0;     // largest capacity of a solver filled so far, for the statistics
+    unique_ptr<CStats> m_Stats;
+    bool m_DumpStats = false;
+    unique_ptr<CResultCache> m_Cache;
+    unique_ptr<CFairScheduler> m_Fair; // guarded by m_MtxSolver
+    bool m_WorkStealing = false;
+    size_t m_SplitMin = 0;             // smallest problem to split, zero = never
+    unique_ptr<CFlowControl> m_Flow;
+    unique_ptr<CTracer> m_Tracer;
+    string m_TraceFile;
+    bool m_Service = false;
+    bool m_Started = false;
+    atomic_bool m_Draining { true };  // no more companies are coming, set at stop() in the service mode
+    mutex m_MtxCompanies;             // guards m_Companies, m_LaneCnt and m_FreeLanes
     vector<ACompanyWrapper> m_Companies;
+    size_t m_LaneCnt = 0;             // lanes ever handed out
+    vector<size_t> m_FreeLanes;       // lanes of the finished companies, reused by the next ones
+    CIoPool m_ReceivePool;            // used instead of the per company threads when m_Pool.m_IoThreads is set
+    CIoPool m_ReturnPool;
 };
 
 class CCompanyWrapper {
 public:
-    explicit CCompanyWrapper ( ACompany company )
-            : m_Company ( std::move(company) ) {}
+    CCompanyWrapper ( ACompany company, size_t lane )
+            : m_Company ( std::move(company) ), m_Lane ( lane ) {}
 
     thread m_ThrReceive;
     /**
@@ -178,143 +2472,1051 @@ public:
     */
     void returner ();
 
-    void notifyQueue () { m_ProblemPacks.notify(); }
-
     void startCompany ( COptimizer & optimizer );
+    /**
+     * Attaches the company to the shared I/O threads instead of starting its own.
+     */
+    void startCompany ( COptimizer & optimizer, CIoPool & receivePool, CIoPool & returnPool );
+    /**
+     * Receives one pack, called by a receiving I/O thread.
+     * @return false after the end of input
+     */
+    bool receiveNext ( COptimizer & optimizer );
+    /**
+     * Returns the packs that are ready, called by a returning I/O thread.
+     * @return true after the end of input was reached
+     */
+    bool returnReady ();
+
+    CSafePPackQueue & packQueue () { return m_ProblemPacks; }
+    const ACompany & company () const { return m_Company; }
+    size_t lane () const { return m_Lane; }
+    /**
+     * Makes the receiving stop before the next waitForPack.
+     */
+    void remove () { m_Removing.store ( true ); }
+    CFlowControl::TUsage & usage () { return m_Usage; }
+    /**
+     * Parks the company multiplexed on the I/O threads while it may not take another pack.
+     * @return true if parked, the flow control resumes it then
+     */
+    bool park ( COptimizer & optimizer );
+    /**
+     * @return true once every received pack was returned and nothing refers to the company any more
+     */
+    bool finished () { return m_Returned.load() && m_ProblemPacks.idle(); }
+    /**
+     * Joins the threads of the company, if it has its own.
+     */
+    void join () {
+        if ( m_ThrReceive.joinable() )
+            m_ThrReceive.join();
+        if ( m_ThrReturn.joinable() )
+            m_ThrReturn.join();
+    }
 
 private:
+    /**
+     * Hands a received pack over to the optimizer.
+     */
+    void receivePack ( COptimizer & optimizer, AProblemPack pPack );
+    void finishReceiving ( COptimizer & optimizer );
+    /**
+     * Blocks the receiver while the company may not take another pack.
+     */
+    void throttle ( COptimizer & optimizer );
+    AProblemPack nextPack ();
+    void returnPack ( const AProblemPackWrapper & pack );
+
     ACompany m_Company;
+    size_t m_Lane;                           // index of the company in the optimizer, reused once it finished
     CSafePPackQueue m_ProblemPacks;
+    atomic_bool m_ReturnScheduled { false }; // the company is in the return pool or being served by it
+    atomic_bool m_Removing { false };
+    atomic_bool m_Returned { false };        // the returning reached the end of input
+    CFlowControl * m_Flow = nullptr;         // of the optimizer, nullptr without backpressure
+    CFlowControl::TUsage m_Usage;
+    CIoPool * m_ReceivePool = nullptr;       // resumes the parked company
 };
-/**
- * Notifies returner thread of each company under it's lock.
- */
-void COptimizer::notifyCompanies () {
-    for ( const auto & company : m_Companies )
-        company->notifyQueue();
+AProgtestSolver COptimizer::createSolver ( CStats * stats ) {
+    if ( s_NativeSolver )
+        return make_shared<CNativeSolver> ( NATIVE_SOLVER_CAPACITY );
+    if ( ! s_SharedBudget || s_SharedBudget->load ( memory_order_relaxed ) > 0 ) {
+        AProgtestSolver solver = createProgtestSolver();
+        if ( solver && solver->hasFreeCapacity() ) {
+            if ( ! s_SharedBudget )
+                return solver;
+            solver = make_shared<CBudgetSolver> ( std::move ( solver ), *s_SharedBudget );
+            if ( solver->hasFreeCapacity() )
+                return solver;
+        }
+    }
+    if ( stats )
+        stats->m_SolversUseless++;
+    return make_shared<CNativeSolver> ( NATIVE_SOLVER_CAPACITY );
+}
+
+ASolverWrapper COptimizer::takeSolver () {
+    if ( ASolverWrapper solver = m_Provider.take() )
+        return solver;
+    if ( m_Stats )
+        m_Stats->m_SolversInline++;
+    ASolverWrapper solver = m_SolverPool.acquire();
+    solver->init ( [ this ] { return createSolver ( m_Stats.get() ); } );
+    return solver;
+}
+
+void COptimizer::stashSolver ( ASolverWrapper solver ) {
+//    if ( solver ) fprintf ( stderr, "Stashing solver filled: %ld\n", solver->size() );
+    if ( m_Stats ) {
+        m_Stats->m_SolverFill.add ( solver->size() );
+        ( solver->hasFreeCapacity() ? m_Stats->m_PartialSolvers : m_Stats->m_FullSolvers )++;
+    }
+    size_t depth = m_FullSolvers.push ( std::move ( solver ) );
+    if ( m_WorkerCnt.load() < m_Pool.m_MaxWorkers && depth > m_Pool.m_GrowBacklog * m_WorkerCnt.load() )
+        spawnWorker();
+}
+
+void COptimizer::spawnWorker () {
+    unique_lock<mutex> lk ( m_MtxWorkers );
+    for ( auto id : m_ExitedWorkers )
+        for ( auto it = m_Workers.begin(); it != m_Workers.end(); ++it )
+            if ( it->get_id() == id ) {
+                it->join();
+                m_Workers.erase ( it );
+                break;
+            }
+    m_ExitedWorkers.clear();
+    if ( m_WorkerCnt.load() >= m_Pool.m_MaxWorkers )
+        return;
+    m_WorkerCnt++;
+    m_Workers.emplace_back ( &COptimizer::worker, this );
+#ifdef __linux__
+    if ( m_Pool.m_PinWorkers ) {
+        cpu_set_t cpus;
+        CPU_ZERO ( &cpus );
+        CPU_SET ( m_WorkerSeq % max ( 1u, thread::hardware_concurrency() ), &cpus );
+        pthread_setaffinity_np ( m_Workers.back().native_handle(), sizeof ( cpus ), &cpus );
+    }
+#endif /* __linux__ */
+    m_WorkerSeq++;
+    if ( m_Stats )
+        m_Stats->m_WorkersStarted++;
+}
+
+COptimizer::ESplit COptimizer::splitProblem ( const AProblemPackWrapper & pack, const AProblem & problem,
+                                CResultCache::TEntry * entry, vector<TPlacement> & placements ) {
+    // reused by the calling receiver
+    static thread_local vector<AProblem> parts;
+    parts.clear();
+    int base;
+    // a single part is the problem itself, less the intervals without a payment
+    if ( ! CNativeSolver::split ( *problem, parts, base ) || ( parts.size() == 1 && base == 0 ) )
+        return ESplit::NONE;
+    if ( m_Stats ) {
+        m_Stats->m_SplitProblems++;
+        m_Stats->m_SplitParts += parts.size();
+    }
+    if ( parts.empty() ) {
+        problem->m_MaxProfit = base;
+        if ( entry )
+            m_Cache->complete ( entry, base );
+        return ESplit::SOLVED;
+    }
+    ASplit split = make_shared<TSplit> ();
+    split->m_Problem = problem;
+    split->m_Pack = pack;
+    split->m_Entry = entry;
+    split->m_Parts.swap ( parts );
+    split->m_Base = base;
+    split->m_Unsolved.store ( split->m_Parts.size(), memory_order_relaxed );
+    for ( const auto & part : split->m_Parts )
+        placements.push_back ( { &part, nullptr, split } );
+    return ESplit::PARTS;
+}
+
+void COptimizer::placeProblem ( const AProblemPackWrapper & pack, const AProblem & problem,
+                                CResultCache::TEntry * entry, const ASplit & split, vector<ASolverWrapper> & full ) {
+    // a large part goes to another solver than the previous part, so that different workers solve them,
+    // the parts the vector lanes take are cheap and stay batched together
+    if ( split && problem->m_Intervals.size() > CNativeSolver::BATCH_INTERVALS && m_Solver && m_Solver->holdsPartOf ( split ) )
+        full.push_back ( std::move ( m_Solver ) );
+    if ( ! m_Solver )
+        m_Solver = takeSolver();
+    if ( split )
+        m_Solver->addPart ( split, problem );
+    else
+        m_Solver->addProblem ( pack, problem, entry );
+    if ( m_Stats && --pack->m_Unplaced == 0 )
+        packPlaced ( *pack );
+    if ( ! m_Solver->hasFreeCapacity() ) {
+        m_LargestCapacity = max ( m_LargestCapacity, m_Solver->size() );
+        full.push_back ( std::move ( m_Solver ) );
+    }
+}
+
+void COptimizer::packPlaced ( CProblemPackWrapper & pack ) {
+    uint64_t now = nowNs();
+    pack.m_Placed.store ( now, memory_order_relaxed );
+    m_Stats->m_Intake.add ( now - pack.m_Received );
+}
+
+void COptimizer::fillFair ( vector<ASolverWrapper> & full, size_t budget ) {
+    CFairScheduler::TItem item;
+    while ( full.size() < budget && m_Fair->pop ( item ) )
+        placeProblem ( item.m_Pack, *item.m_Problem, item.m_Entry, item.m_Split, full );
+}
+
+size_t COptimizer::fairBudget () {
+    size_t target = ( m_Pool.m_GrowBacklog + 1 ) * max ( size_t ( 1 ), m_WorkerCnt.load() );
+    size_t queued = m_FullSolvers.size();
+    return max ( size_t ( 1 ), target - min ( target, queued ) );
+}
+
+void COptimizer::refillFair () {
+    // reused by the calling worker
+    static thread_local vector<ASolverWrapper> full;
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    if ( m_Closed )
+        return;
+    fillFair ( full, fairBudget() );
+    flushThrottled ( full );
+    lk.unlock();
+    provideSolver();
+    for ( auto & solver : full )
+        stashSolver ( std::move ( solver ) );
+    full.clear();
+}
+
+void COptimizer::addProblems ( const AProblemPackWrapper & pack, size_t lane ) {
+    // reused by the calling receiver
+    static thread_local vector<ASolverWrapper> full;
+    static thread_local vector<TPlacement> misses;
+    size_t hits = 0;
+    // looked up and split before taking the filling lock, only the misses and the parts need a solver
+    for ( const auto & problem : pack->m_ProblemPack->m_Problems ) {
+        CResultCache::TEntry * entry = nullptr;
+        if ( m_Cache )
+            switch ( m_Cache->lookup ( problem, pack, entry ) ) {
+                case CResultCache::ELookup::HIT:     hits++; continue;
+                case CResultCache::ELookup::PENDING: continue;
+                case CResultCache::ELookup::MISS:    break;
+            }
+        if ( m_SplitMin && s_NativeSolver && problem->m_Intervals.size() >= m_SplitMin ) {
+            ESplit res = splitProblem ( pack, problem, entry, misses );
+            hits += res == ESplit::SOLVED;
+            if ( res != ESplit::NONE )
+                continue;
+        }
+        misses.push_back ( { &problem, entry, nullptr } );
+    }
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    if ( m_Stats ) {
+        pack->m_Unplaced = misses.size();
+        if ( misses.empty() )
+            packPlaced ( *pack );
+    }
+    if ( m_Fair ) {
+        for ( auto & miss : misses )
+            m_Fair->push ( lane, { pack, miss.m_Problem, miss.m_Entry, std::move ( miss.m_Split ) } );
+        fillFair ( full, fairBudget() );
+    }
+    else
+        for ( const auto & miss : misses )
+            placeProblem ( pack, *miss.m_Problem, miss.m_Entry, miss.m_Split, full );
+    lk.unlock();
+    misses.clear();
+    provideSolver();
+    if ( hits )
+        pack->finishProblems ( hits );
+    for ( auto & solver : full )
+        stashSolver ( std::move ( solver ) );
+    full.clear();
+    if ( m_FlushPolicy.m_FlushWhenIdle && m_FullSolvers.waiting() > 0 )
+        flushSolver ( true );
+}
+
+bool COptimizer::flushSolver ( bool idle ) {
+    // a partially filled solver is not flushed while there are problems to fill it with
+    if ( m_Fair && m_Fair->size() ) {
+        refillFair();
+        return true;
+    }
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    // the last solver was already stashed, or there is nothing to flush
+    if ( ! m_Solver )
+        return false;
+    if ( ! idle && ( m_FlushPolicy.m_MaxWait == chrono::microseconds::zero()
+                     || chrono::steady_clock::now() - m_Solver->firstAdded() < m_FlushPolicy.m_MaxWait ) )
+        return false;
+    if ( ! chargeSpare() )
+        return false;
+    ASolverWrapper solver = std::move ( m_Solver );
+    lk.unlock();
+    stashSolver ( std::move ( solver ) );
+    return true;
+}
+
+void COptimizer::companyFinishedReceiving () {
+    // exactly one receiver observes the last decrement
+    if ( --m_Receiving != 0 ) {
+        if ( m_Service )
+            flushFinished();
+        return;
+    }
+    receiversIdle();
+}
+
+void COptimizer::flushFinished () {
+    vector<ASolverWrapper> full;
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    if ( m_Closed )
+        return;
+    // the problems of the company may still wait for their turn, or share a solver with those of others
+    if ( m_Fair )
+        fillFair ( full, SIZE_MAX );
+    if ( m_Solver )
+        forceSolver ( full );
+    lk.unlock();
+    provideSolver();
+    for ( auto & solver : full )
+        stashSolver ( std::move ( solver ) );
+}
+
+void COptimizer::receiversIdle () {
+    vector<ASolverWrapper> full;
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    // the queue was closed already, or a company was added in the meantime
+    if ( m_Closed || m_Receiving.load() )
+        return;
+    // both stop() and the last receiver get here, whichever sees the other one done closes the queue
+    bool last = m_Draining.load();
+    m_Closed = last;
+    if ( m_Fair )
+        fillFair ( full, SIZE_MAX );
+    // stash the remaining (not necessarily full) solver, nothing else would fill it
+    if ( m_Solver )
+        full.push_back ( std::move ( m_Solver ) );
+    lk.unlock();
+    for ( auto & solver : full )
+        stashSolver ( std::move ( solver ) );
+    if ( last )
+        m_FullSolvers.close();
+}
+
+bool COptimizer::chargeSpare () {
+    if ( s_NativeSolver )
+        return true;
+    // a solver filled so far does not bound the capacity of the later ones, the unused part could be underestimated
+    size_t maxCapacity = m_FlushPolicy.m_MaxCapacity;
+    if ( maxCapacity == 0 )
+        return false;
+    size_t unused = maxCapacity - min ( maxCapacity, m_Solver->size() );
+    if ( unused > m_SpareCapacity )
+        return false;
+    m_SpareCapacity -= unused;
+    return true;
+}
+
+void COptimizer::flushThrottled ( vector<ASolverWrapper> & full ) {
+    if ( ! m_Flow || ! m_Flow->throttled() || ! m_Solver || ( m_Fair && m_Fair->size() ) )
+        return;
+    forceSolver ( full );
 }
 
-bool COptimizer::getNewSolver () {
-    m_Solver = make_shared<CSolverWrapper> ( createProgtestSolver() );
-    return m_Solver != nullptr;
+void COptimizer::forceSolver ( vector<ASolverWrapper> & full ) {
+    if ( ! chargeSpare() && m_Stats )
+        m_Stats->m_OverSpare++;
+    full.push_back ( std::move ( m_Solver ) );
 }
 
-void COptimizer::stashSolver () {
-//    if ( m_Solver ) fprintf ( stderr, "Stashing solver filled: %ld\n", m_Solver->size() );
-    m_FullSolvers.push ( m_Solver );
+void COptimizer::receiverThrottled () {
+    vector<ASolverWrapper> full;
+    unique_lock<mutex> lk = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+    if ( m_Closed )
+        return;
+    if ( m_Fair )
+        fillFair ( full, fairBudget() );
+    flushThrottled ( full );
+    lk.unlock();
+    provideSolver();
+    for ( auto & solver : full )
+        stashSolver ( std::move ( solver ) );
 }
 
 void COptimizer::start ( int threadCount ) {
-    for ( const auto & company : m_Companies )
-        company->startCompany( *this );
+    TPoolPolicy pool;
+    pool.m_MinWorkers = pool.m_MaxWorkers = threadCount;
+    start ( pool );
+}
 
-    for ( int i = 0; i < threadCount; i++ )
-        m_Workers.emplace_back ( &COptimizer::worker, this );
+void COptimizer::start ( const TPoolPolicy & pool ) {
+    if ( m_Tracer )
+        CTracer::activate ( m_Tracer.get() );
+    m_Pool = pool;
+    // an empty pool would never solve anything
+    m_Pool.m_MinWorkers = max ( size_t ( 1 ), m_Pool.m_MinWorkers );
+    m_Pool.m_MaxWorkers = max ( m_Pool.m_MinWorkers, m_Pool.m_MaxWorkers );
+    if ( m_WorkStealing )
+        m_FullSolvers.setWorkStealing ( m_Pool.m_MaxWorkers );
+    unique_lock<mutex> lk ( m_MtxCompanies );
+    m_Started = true;
+    m_Receiving = m_Companies.size();
+    if ( m_Companies.empty() )
+        receiversIdle();
+    else
+        provideSolver();
+    for ( size_t i = 0; i < m_Pool.m_MinWorkers; i++ )
+        spawnWorker();
+    if ( m_Pool.m_IoThreads ) {
+        // in the service mode, the I/O threads wait for the companies added later until stop()
+        size_t companyCnt = m_Companies.size() + m_Service;
+        m_ReceivePool.start ( m_Pool.m_IoThreads, companyCnt, [ this ] ( CCompanyWrapper * company ) {
+            // scheduled again once its packs are returned
+            if ( company->park ( *this ) )
+                return false;
+            // back to the end of the line, the other companies get their turn
+            if ( ! company->receiveNext ( *this ) )
+                return true;
+            m_ReceivePool.schedule ( company );
+            return false;
+        }, "io receiver" );
+        m_ReturnPool.start ( m_Pool.m_IoThreads, companyCnt, [] ( CCompanyWrapper * company ) {
+            return company->returnReady();
+        }, "io returner" );
+    }
+    for ( const auto & company : m_Companies )
+        if ( m_Pool.m_IoThreads )
+            company->startCompany ( *this, m_ReceivePool, m_ReturnPool );
+        else
+            company->startCompany( *this );
 }
 
 void COptimizer::stop () {
 //    fprintf ( stderr, "COptimizer::stop\n");
-    for ( auto & worker : m_Workers )
-        worker.join();
-    for ( auto & company : m_Companies ) {
-        company->m_ThrReceive.join();
-        company->m_ThrReturn.join();
+    unique_lock<mutex> lkCompanies ( m_MtxCompanies );
+    vector<ACompanyWrapper> companies = m_Companies;
+    m_Draining = true;
+    lkCompanies.unlock();
+    if ( m_Service ) {
+        receiversIdle();
+        if ( m_ReceivePool.running() ) {
+            m_ReceivePool.done();
+            m_ReturnPool.done();
+        }
+    }
+    // receivers first, after them only the workers stash solvers and spawn more workers
+    if ( m_ReceivePool.running() )
+        m_ReceivePool.join();
+    else
+        for ( auto & company : companies )
+            company->m_ThrReceive.join();
+    // a worker being joined may still spawn another one, until none is left
+    while ( true ) {
+        list<thread> workers;
+        unique_lock<mutex> lk ( m_MtxWorkers );
+        workers.swap ( m_Workers );
+        m_ExitedWorkers.clear();
+        lk.unlock();
+        if ( workers.empty() )
+            break;
+        for ( auto & worker : workers )
+            worker.join();
+    }
+    if ( m_ReturnPool.running() )
+        m_ReturnPool.join();
+    else
+        for ( auto & company : companies )
+            company->m_ThrReturn.join();
+    if ( m_Stats && m_DumpStats )
+        dumpStats ( cerr );
+    if ( m_Tracer ) {
+        // every traced thread has been joined
+        CTracer::activate ( nullptr );
+        if ( FILE * fp = fopen ( m_TraceFile.c_str(), "w" ) ) {
+            m_Tracer->dump ( fp );
+            fclose ( fp );
+        }
+        else
+            cerr << "COptimizer: cannot write the trace to " << m_TraceFile << "\n";
+    }
+}
+
+void COptimizer::dumpStats ( ostream & os ) {
+    if ( ! m_Stats )
+        return;
+    size_t packsQueued = 0, packsMaxDepth = 0;
+    uint64_t packsSpun = 0, packsParked = 0;
+    unique_lock<mutex> lk ( m_MtxCompanies );
+    for ( const auto & company : m_Companies ) {
+        packsQueued += company->packQueue().size();
+        packsMaxDepth = max ( packsMaxDepth, company->packQueue().maxDepth() );
+        packsSpun += company->packQueue().waits().m_SpinHits;
+        packsParked += company->packQueue().waits().m_Parks;
+    }
+    lk.unlock();
+    const CStats & st = *m_Stats;
+    uint64_t stashed = st.m_FullSolvers + st.m_PartialSolvers;
+    os << "COptimizer stats:\n"
+       << "  packs received " << st.m_PacksReceived << ", returned " << st.m_PacksReturned
+       << ", problems received " << st.m_ProblemsReceived << "\n";
+    st.m_Intake.print ( os, "intake" );
+    st.m_SolveWait.print ( os, "solve wait" );
+    st.m_ReturnWait.print ( os, "return wait" );
+    st.m_Turnaround.print ( os, "turnaround" );
+    os << "  solver queue depth " << m_FullSolvers.size() << ", max " << m_FullSolvers.maxDepth() << "\n"
+       << "  company queues depth " << packsQueued << " in total, max " << packsMaxDepth << " per company\n"
+       << "  waits spun / parked: solver queue " << m_FullSolvers.waits().m_SpinHits << " / " << m_FullSolvers.waits().m_Parks
+       << " ( spin budget " << m_FullSolvers.waits().budget() << " ), company queues " << packsSpun << " / " << packsParked << "\n"
+       << "  solvers stashed full " << st.m_FullSolvers << ", partial " << st.m_PartialSolvers
+       << ", problems per solver p50 " << st.m_SolverFill.percentile ( 0.5 ) << ", avg "
+       << ( stashed ? double ( st.m_ProblemsReceived ) / stashed : 0 );
+    if ( m_LargestCapacity )
+        os << ", fill ratio " << ( stashed ? double ( st.m_ProblemsReceived ) / stashed / m_LargestCapacity : 0 );
+    os << "\n"
+       << "  workers busy " << st.m_WorkerBusyNs / 1000000 << " ms, idle " << st.m_WorkerIdleNs / 1000000 << " ms"
+       << ", started " << st.m_WorkersStarted << ", retired " << st.m_WorkersRetired << "\n";
+    if ( st.m_SolversInline || st.m_SolversUseless )
+        os << "  solvers created inline " << st.m_SolversInline << ", useless from the library " << st.m_SolversUseless << "\n";
+    if ( st.m_OverSpare )
+        os << "  solvers forced out beyond the spare capacity " << st.m_OverSpare << "\n";
+    if ( st.m_SplitProblems )
+        os << "  problems split " << st.m_SplitProblems << " into " << st.m_SplitParts << " parts\n";
+    if ( m_Flow ) {
+        CFlowControl::TUsage total = m_Flow->total();
+        os << "  in flight packs " << total.m_Packs << ", problems " << total.m_Problems << ", bytes " << total.m_Bytes
+           << ", limit hits by company " << m_Flow->m_CompanyLimitHits << ", in total " << m_Flow->m_TotalLimitHits
+           << ", throttled " << m_Flow->m_ThrottledNs / 1000000 << " ms\n";
+    }
+    if ( m_Cache )
+        os << "  cache hits " << m_Cache->m_Hits << ", coalesced " << m_Cache->m_Coalesced
+           << ", misses " << m_Cache->m_Misses << ", evictions " << m_Cache->m_Evictions << "\n";
+}
+void COptimizer::addCompany ( const ACompany& company, size_t weight ) {
+    unique_lock<mutex> lk ( m_MtxCompanies );
+    if ( m_Started && m_Draining )
+        throw logic_error ( "COptimizer::addCompany: the optimizer does not accept companies any more" );
+    reapCompanies();
+    size_t lane = m_LaneCnt;
+    if ( m_FreeLanes.empty() )
+        m_LaneCnt++;
+    else {
+        lane = m_FreeLanes.back();
+        m_FreeLanes.pop_back();
+    }
+    ACompanyWrapper wrapper = make_shared<CCompanyWrapper> ( company, lane );
+    if ( m_Fair ) {
+        unique_lock<mutex> lkSolver = lockTraced ( m_MtxSolver, "lock m_MtxSolver" );
+        m_Fair->addLane ( lane, weight );
+    }
+    m_Companies.push_back ( wrapper );
+    if ( ! m_Started )
+        return;
+    m_Receiving++;
+    if ( m_Pool.m_IoThreads ) {
+        m_ReceivePool.attach();
+        m_ReturnPool.attach();
+        wrapper->startCompany ( *this, m_ReceivePool, m_ReturnPool );
+    }
+    else
+        wrapper->startCompany ( *this );
+}
+bool COptimizer::removeCompany ( const ACompany & company ) {
+    unique_lock<mutex> lk ( m_MtxCompanies );
+    auto it = find_if ( m_Companies.begin(), m_Companies.end(), [ &company ] ( const ACompanyWrapper & wrapper ) {
+        return wrapper->company() == company;
+    } );
+    if ( it == m_Companies.end() )
+        return false;
+    ACompanyWrapper wrapper = std::move ( *it );
+    m_Companies.erase ( it );
+    bool started = m_Started;
+    lk.unlock();
+    wrapper->remove();
+    if ( ! started ) {
+        lk.lock();
+        m_FreeLanes.push_back ( wrapper->lane() );
+        return true;
     }
+    // a throttled company would not get to notice it
+    if ( m_Flow && m_Flow->unpark ( wrapper->usage() ) )
+        m_ReceivePool.schedule ( wrapper.get() );
+    wrapper->join();
+    // the last references to its packs are dropped by the workers shortly after the packs are returned
+    wrapper->packQueue().waitIdle();
+    lk.lock();
+    m_FreeLanes.push_back ( wrapper->lane() );
+    return true;
 }
-void COptimizer::addCompany ( const ACompany& company ) {
-    m_Companies.emplace_back ( make_shared<CCompanyWrapper> ( company ) );
+void COptimizer::reapCompanies () {
+    for ( auto it = m_Companies.begin(); it != m_Companies.end(); )
+        if ( ( *it )->finished() ) {
+            ( *it )->join();
+            m_FreeLanes.push_back ( ( *it )->lane() );
+            it = m_Companies.erase ( it );
+        }
+        else
+            ++it;
 }
 void COptimizer::worker () {
 //    atomic_int id = workerCounter++; // debug
 //    fprintf ( stderr, "WORKER: Starting %d\n", id.load() );
     // if all companies won't get new problems and solver queue is empty, break
 
+    // workers above the minimum wake up to check whether they are still needed
+    chrono::microseconds timeout = m_FlushPolicy.m_MaxWait;
+    if ( m_Pool.m_MaxWorkers > m_Pool.m_MinWorkers ) {
+        chrono::microseconds idleTimeout = m_Pool.m_IdleTimeout;
+        timeout = timeout == chrono::microseconds::zero() ? idleTimeout : min ( timeout, idleTimeout );
+    }
+    auto idleSince = chrono::steady_clock::now();
+    m_FullSolvers.attachWorker();
+    CTracer::threadName ( "worker" );
     while ( true ) {
-        unique_lock<mutex> lk ( m_MtxSolver );
-        m_CVWorker.wait ( lk, [ this ] { return ! m_FullSolvers.empty() || m_KillWorkers ; } );
-        if ( m_FullSolvers.empty() && m_KillWorkers )
+        uint64_t idleFrom = m_Stats ? nowNs() : 0;
+        if ( auto s = m_FullSolvers.pop ( timeout ) ) {
+            if ( m_Stats ) {
+                uint64_t busyFrom = nowNs();
+                m_Stats->m_WorkerIdleNs += busyFrom - idleFrom;
+                s->solve ( m_Cache.get() );
+                m_Stats->m_WorkerBusyNs += nowNs() - busyFrom;
+            }
+            else
+                s->solve ( m_Cache.get() );
+            if ( m_Fair && m_Fair->size() )
+                refillFair();
+            idleSince = chrono::steady_clock::now();
+            continue;
+        }
+        if ( m_Stats )
+            m_Stats->m_WorkerIdleNs += nowNs() - idleFrom;
+        if ( m_FullSolvers.closed() )
             break;
-        auto s = m_FullSolvers.front(); m_FullSolvers.pop();
-        lk.unlock();
-
-        s->solve();
-//        fprintf ( stderr, "WORKER: Notifying companies\n" );
-        notifyCompanies();
+        // timed out, the partially filled solver may be old enough
+        flushSolver ( false );
+        if ( chrono::steady_clock::now() - idleSince >= m_Pool.m_IdleTimeout && retireWorker() ) {
+            m_FullSolvers.detachWorker();
+            unique_lock<mutex> lk ( m_MtxWorkers );
+            m_ExitedWorkers.push_back ( this_thread::get_id() );
+            return;
+        }
     }
+    m_FullSolvers.detachWorker();
+    m_WorkerCnt--;
 
 //    fprintf ( stderr, "WORKER: Stopping %d\n", id.load() );
 }
+AProblemPack CCompanyWrapper::nextPack () {
+    CTraceSpan span ( "waitForPack" );
+    return m_Company->waitForPack();
+}
 void CCompanyWrapper::returner () {
+    CTracer::threadName ( "returner" );
 //    fprintf ( stderr, "RETURNER: start%d\n", m_CompanyID );
     while ( auto pack = m_ProblemPacks.pop() ) {
 //        fprintf ( stderr, "RETURNER: returning pack %d\n", m_CompanyID );
-        m_Company->solvedPack ( pack->m_ProblemPack );
+        returnPack ( pack );
     }
+    m_Returned.store ( true );
+    m_ProblemPacks.ended();
 //    fprintf ( stderr, "RETURNER: stop %d\n", m_CompanyID);
 }
-void CCompanyWrapper::receiver ( COptimizer & optimizer  ) {
-//    fprintf ( stderr, "RECEIVER: start %d\n", m_CompanyID);
-    while ( AProblemPack pPack = m_Company->waitForPack() ) {
-        auto packWrapPtr = make_shared<CProblemPackWrapper> ( pPack );
-        m_ProblemPacks.push ( packWrapPtr );
-
-        unique_lock<mutex> lk ( optimizer.m_MtxSolver );
-        for ( const auto & problem : pPack->m_Problems ) {
-            optimizer.m_Solver->addProblem ( make_shared<CProblemWrapper>
-                    ( CProblemWrapper ( problem, packWrapPtr ) ) );
-            if ( ! optimizer.m_Solver->hasFreeCapacity() ) {
-                optimizer.stashSolver();
-                optimizer.getNewSolver();
+void CCompanyWrapper::returnPack ( const AProblemPackWrapper & pack ) {
+    // counted the same as when received, the company may change the pack once it has it back
+    size_t problems = 0, bytes = 0;
+    if ( m_Flow ) {
+        problems = pack->m_ProblemPack->m_Problems.size();
+        bytes = CFlowControl::packBytes ( *pack->m_ProblemPack );
+    }
+    {
+        CTraceSpan span ( "solvedPack" );
+        m_Company->solvedPack ( pack->m_ProblemPack );
+    }
+    if ( m_Flow ) {
+        static thread_local vector<CCompanyWrapper *> resumed;
+        m_Flow->release ( m_Usage, problems, bytes, resumed );
+        for ( CCompanyWrapper * company : resumed )
+            m_ReceivePool->schedule ( company );
+        resumed.clear();
+    }
+    if ( CStats * stats = pack->m_Stats ) {
+        uint64_t now = nowNs(), solved = pack->m_Solved.load ( memory_order_relaxed );
+        // empty packs are never solved by a worker
+        if ( solved == 0 )
+            solved = pack->m_ProblemPack->m_Problems.empty() ? pack->m_Placed.load ( memory_order_relaxed ) : now;
+        stats->m_ReturnWait.add ( now - solved );
+        stats->m_Turnaround.add ( now - pack->m_Received );
+        stats->m_PacksReturned++;
+    }
+}
+bool CCompanyWrapper::returnReady () {
+    AProblemPackWrapper pack;
+    while ( true ) {
+        while ( m_ProblemPacks.tryPop ( pack ) ) {
+            if ( ! pack ) {
+                m_Returned.store ( true );
+                m_ProblemPacks.ended();
+                return true;
             }
+            returnPack ( pack );
         }
-        lk.unlock();
+        m_ReturnScheduled.store ( false );
+        // the front may have become ready before the flag was cleared, its notification was dropped then
+        if ( ! m_ProblemPacks.frontReady() || m_ReturnScheduled.exchange ( true ) )
+            return false;
+    }
+}
+void CCompanyWrapper::receiver ( COptimizer & optimizer  ) {
+//    fprintf ( stderr, "RECEIVER: start %d\n", m_CompanyID);
+    CTracer::threadName ( "receiver" );
+    while ( true ) {
+        throttle ( optimizer );
+        AProblemPack pPack = m_Removing.load() ? nullptr : nextPack();
+        if ( ! pPack )
+            break;
+        receivePack ( optimizer, std::move ( pPack ) );
         // here, if all problems of a given problem pack have been successfully given to solvers
     }
     // here, if there are no more problems to be given for processing
-    AProblemPackWrapper eofPack = nullptr;
-    m_ProblemPacks.push ( eofPack );
-    optimizer.m_FinishedReceivingCompaniesCnt++;
-    // stash the last (not necessarily full) solver
-    unique_lock<mutex> lk ( optimizer.m_MtxSolver );
-    if ( optimizer.allCompaniesFinishedReceiving() ) {
-        optimizer.stashSolver();
-        optimizer.m_KillWorkers = true;
-        optimizer.m_CVWorker.notify_all();
-    }
+    finishReceiving ( optimizer );
 //    fprintf ( stderr, "RECEIVER: stop %d\n", m_CompanyID );
 }
+bool CCompanyWrapper::receiveNext ( COptimizer & optimizer ) {
+    AProblemPack pPack = m_Removing.load() ? nullptr : nextPack();
+    if ( ! pPack ) {
+        finishReceiving ( optimizer );
+        return false;
+    }
+    receivePack ( optimizer, std::move ( pPack ) );
+    return true;
+}
+void CCompanyWrapper::throttle ( COptimizer & optimizer ) {
+    if ( ! m_Flow || ! m_Flow->block ( m_Usage ) )
+        return;
+    optimizer.receiverThrottled();
+    CTraceSpan span ( "throttled" );
+    m_Flow->wait ( m_Usage, m_Removing );
+}
+bool CCompanyWrapper::park ( COptimizer & optimizer ) {
+    if ( ! m_Flow || m_Removing.load() || ! m_Flow->park ( m_Usage, this ) )
+        return false;
+    optimizer.receiverThrottled();
+    return true;
+}
+void CCompanyWrapper::receivePack ( COptimizer & optimizer, AProblemPack pPack ) {
+    CStats * stats = optimizer.stats();
+    size_t problemCnt = pPack->m_Problems.size();
+    if ( m_Flow )
+        m_Flow->acquire ( m_Usage, problemCnt, CFlowControl::packBytes ( *pPack ) );
+    AProblemPackWrapper packWrapPtr = m_ProblemPacks.push ( std::move ( pPack ), stats );
+    optimizer.addProblems ( packWrapPtr, m_Lane );
+    if ( stats ) {
+        stats->m_PacksReceived++;
+        stats->m_ProblemsReceived += problemCnt;
+    }
+}
+void CCompanyWrapper::finishReceiving ( COptimizer & optimizer ) {
+    m_ProblemPacks.pushEnd();
+    optimizer.companyFinishedReceiving();
+}
 
 void CCompanyWrapper::startCompany ( COptimizer & optimizer ) {
+    m_Flow = optimizer.flowControl();
 //    fprintf ( stderr, "Starting company %d\n", m_CompanyID );
     m_ThrReceive = thread ( &CCompanyWrapper::receiver, this, ref(optimizer) );
     m_ThrReturn = thread ( &CCompanyWrapper::returner, this );
 }
+void CCompanyWrapper::startCompany ( COptimizer & optimizer, CIoPool & receivePool, CIoPool & returnPool ) {
+    m_Flow = optimizer.flowControl();
+    m_ReceivePool = &receivePool;
+    // only the first of the notifications that come before the returning thread gets to it schedules the company
+    m_ProblemPacks.setOnReady ( [ this, &returnPool ] {
+        if ( ! m_ReturnScheduled.exchange ( true ) )
+            returnPool.schedule ( this );
+    } );
+    receivePool.schedule ( this );
+}
 
 #ifndef __PROGTEST__
+#ifdef BENCHMARK
+/**
+ * Parses "a,b,c" into a list of numbers.
+ */
+static vector<size_t> parseList ( const char * str ) {
+    vector<size_t> res;
+    for ( const char * p = str; *p; ) {
+        char * end;
+        res.push_back ( strtoul ( p, &end, 10 ) );
+        p = *end == ',' ? end + 1 : end + strlen ( end );
+    }
+    return res;
+}
+/**
+ * Parses "min:max" ( or a single value ) into a range.
+ */
+template<typename T>
+static void parseRange ( const char * str, T & lo, T & hi ) {
+    char * end;
+    lo = hi = strtol ( str, &end, 10 );
+    if ( *end == ':' )
+        hi = strtol ( end + 1, &end, 10 );
+}
+
+static uint64_t percentileOf ( const vector<uint64_t> & sorted, double fraction ) {
+    if ( sorted.empty() )
+        return 0;
+    return sorted[min ( sorted.size() - 1, size_t ( ceil ( fraction * sorted.size() ) ) - ( fraction > 0 ) )];
+}
+
+/**
+ * Runs the optimizer with the native solver on generated load, once for each combination of company and worker counts.
+ */
+int main ( int argc, char * argv[] ) {
+    vector<size_t> companyCounts { 10 }, workerCounts { 6 };
+    TBenchConfig config;
+    TFlushPolicy flushPolicy;
+    bool stats = false, elastic = false, pin = false;
+    size_t ioThreads = 0, cacheCapacity = 0, quantum = 0, splitMin = 0;
+    bool longestFirst = false, stealing = false, service = false, library = false;
+    size_t shards = 0;
+    TFlowLimits companyLimits, totalLimits;
+    string recordPrefix, replayPrefix, traceFile;
+    double speed = 0;
+    for ( int i = 1; i < argc; i++ ) {
+        string opt = argv[i];
+        const char * val = i + 1 < argc ? argv[i + 1] : nullptr;
+        if ( opt == "--idle" ) { flushPolicy.m_FlushWhenIdle = true; continue; }
+        if ( opt == "--stats" ) { stats = true; continue; }
+        if ( opt == "--elastic" ) { elastic = true; continue; }
+        if ( opt == "--pin" ) { pin = true; continue; }
+        if ( opt == "--lpt" ) { longestFirst = true; continue; }
+        if ( opt == "--steal" ) { stealing = true; continue; }
+        if ( opt == "--service" ) { service = true; continue; }
+        if ( opt == "--scalar" ) { CNativeSolver::s_Batched = false; continue; }
+        if ( opt == "--library" ) { library = true; continue; }
+        if ( opt == "--geometric" ) { config.m_PackSizeGeometric = true; continue; }
+        if ( ! val ) {
+            opt = "-h";
+            val = "";
+        }
+        i++;
+        if ( opt == "-c" ) companyCounts = parseList ( val );
+        else if ( opt == "-w" ) workerCounts = parseList ( val );
+        else if ( opt == "-p" ) config.m_Packs = strtoul ( val, nullptr, 10 );
+        else if ( opt == "-s" ) parseRange ( val, config.m_PackSizeMin, config.m_PackSizeMax );
+        else if ( opt == "-i" ) parseRange ( val, config.m_IntervalsMin, config.m_IntervalsMax );
+        else if ( opt == "-k" ) parseRange ( val, config.m_CountMin, config.m_CountMax );
+        else if ( opt == "-a" ) config.m_ArrivalDelay = chrono::microseconds ( strtol ( val, nullptr, 10 ) );
+        else if ( opt == "-r" ) config.m_ReturnDelay = chrono::microseconds ( strtol ( val, nullptr, 10 ) );
+        else if ( opt == "--trace" ) traceFile = val;
+        else if ( opt == "--record" ) recordPrefix = val;
+        else if ( opt == "--replay" ) replayPrefix = val;
+        else if ( opt == "--speed" ) speed = strtod ( val, nullptr );
+        else if ( opt == "--split" ) splitMin = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--fair" ) quantum = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--cache" ) cacheCapacity = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--io" ) ioThreads = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--inflight" ) companyLimits.m_Packs = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--inflight-mb" ) totalLimits.m_Bytes = strtoul ( val, nullptr, 10 ) << 20;
+        else if ( opt == "--spin" ) CSpinPark::s_MaxSpin = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--shards" ) shards = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--seed" ) config.m_Seed = strtoul ( val, nullptr, 10 );
+        else if ( opt == "--flush" ) flushPolicy.m_MaxWait = chrono::microseconds ( strtol ( val, nullptr, 10 ) );
+        else {
+            fprintf ( stderr, "Usage: %s [-c companies,...] [-w workers,...] [-p packs per company] [-s pack size min:max] [--geometric]\n"
+                              "       [-i intervals min:max] [-k count min:max] [-a arrival delay us] [-r return delay us]\n"
+                              "       [--flush max wait us] [--idle] [--elastic] [--pin] [--io threads] [--cache capacity]\n"
+                              "       [--fair quantum] [--lpt] [--steal] [--split min intervals] [--seed n] [--stats]\n"
+                              "       [--record prefix] [--replay prefix [--speed x]] [--trace file.json] [--service]\n"
+                              "       [--inflight packs per company] [--inflight-mb total MB] [--scalar]\n"
+                              "       [--shards processes] [--library] [--spin max pauses]\n"
+                              "       --elastic grows the pool from 1 up to the worker count\n"
+                              "       --io shares that many receiving and returning threads among the companies\n"
+                              "       --record writes the stream of company i to prefix.i, --replay feeds the companies from them\n"
+                              "       at the recorded speed times x, at full speed by default\n"
+                              "       --service adds the companies to an already running optimizer\n"
+                              "       --scalar solves the native problems one by one instead of in vector lanes\n"
+                              "       --shards runs the optimizers in that many processes fed through shared memory,\n"
+                              "       each writes its own --trace file.json.k\n"
+                              "       --library uses the solvers of the attached library, sharing their capacity among the shards\n"
+                              "       --spin bounds the spinning before a wait parks, 0 parks right away\n", argv[0] );
+            return 1;
+        }
+    }
+
+    COptimizer::s_NativeSolver = ! library;
+    // a sample of the results is checked against the plain solver, whatever path solved them
+    config.m_Reference = CNativeSolver::maxProfit;
+    printf ( "%9s %7s %9s %10s %12s %12s %10s %10s %10s\n",
+             "companies", "workers", "time [s]", "packs/s", "problems/s", "p50 [us]", "p99 [us]", "p999 [us]", "max [us]" );
+    for ( size_t c : companyCounts )
+        for ( size_t w : workerCounts ) {
+            vector<ACompanyMeasured> companies;
+            vector<ACompany> inputs;  // the companies, or their recorders
+            size_t problems = 0;
+            for ( size_t j = 0; j < c; j++ ) {
+                string trace = ( replayPrefix.empty() ? recordPrefix : replayPrefix ) + "." + to_string ( j );
+                if ( replayPrefix.empty() )
+                    companies.push_back ( make_shared<CCompanyBench> ( config, j ) );
+                else
+                    companies.push_back ( make_shared<CCompanyReplay> ( trace, speed ) );
+                problems += companies.back()->problemCount();
+                if ( recordPrefix.empty() )
+                    inputs.push_back ( companies.back() );
+                else
+                    inputs.push_back ( make_shared<CCompanyRecorder> ( companies.back(), trace ) );
+            }
+            auto run = [ & ] ( const vector<ACompany> & companies, const string & trace ) {
+                COptimizer optimizer ( flushPolicy );
+                if ( stats )
+                    optimizer.enableStats();
+                if ( cacheCapacity )
+                    optimizer.enableCache ( cacheCapacity );
+                if ( quantum )
+                    optimizer.enableFairness ( quantum );
+                if ( longestFirst )
+                    optimizer.enableLongestFirst();
+                if ( stealing )
+                    optimizer.enableWorkStealing();
+                if ( splitMin )
+                    optimizer.enableSplitting ( splitMin );
+                if ( ! trace.empty() )
+                    optimizer.enableTrace ( trace );
+                if ( companyLimits.m_Packs || totalLimits.m_Bytes )
+                    optimizer.enableBackpressure ( companyLimits, totalLimits );
+                if ( service )
+                    optimizer.enableService();
+                else
+                    for ( const auto & company : companies )
+                        optimizer.addCompany ( company );
+
+                TPoolPolicy pool;
+                pool.m_MinWorkers = elastic ? 1 : w;
+                pool.m_MaxWorkers = w;
+                pool.m_PinWorkers = pin;
+                pool.m_IoThreads = ioThreads;
+                optimizer.start ( pool );
+                if ( service )
+                    for ( const auto & company : companies )
+                        optimizer.addCompany ( company );
+                optimizer.stop();
+            };
+
+            auto begin = chrono::steady_clock::now();
+            if ( ! shards )
+                run ( inputs, traceFile );
+            // the budget of the library solvers of one process ( M = 100 ) is shared by all the shards
+            else if ( ! runSharded ( inputs, shards, library ? 100 : -1,
+                                     [ & ] ( size_t shard, const vector<ACompany> & companies, atomic<int64_t> * budget ) {
+                                         COptimizer::s_SharedBudget = budget;
+                                         run ( companies, traceFile.empty() ? traceFile : traceFile + "." + to_string ( shard ) );
+                                     } ) )
+                throw logic_error ( "a shard failed" );
+            double elapsed = chrono::duration<double> ( chrono::steady_clock::now() - begin ).count();
+
+            vector<uint64_t> turnarounds;
+            for ( const auto & company : companies ) {
+                if ( ! company->allProcessed() )
+                    throw logic_error ( "(some) packs were not correctly processed" );
+                turnarounds.insert ( turnarounds.end(), company->turnarounds().begin(), company->turnarounds().end() );
+            }
+            sort ( turnarounds.begin(), turnarounds.end() );
+            printf ( "%9zu %7zu %9.3f %10.0f %12.0f %12.1f %10.1f %10.1f %10.1f\n", c, w, elapsed,
+                     turnarounds.size() / elapsed, problems / elapsed,
+                     percentileOf ( turnarounds, 0.5 ) / 1e3, percentileOf ( turnarounds, 0.99 ) / 1e3,
+                     percentileOf ( turnarounds, 0.999 ) / 1e3, percentileOf ( turnarounds, 1 ) / 1e3 );
+            fflush ( stdout );
+        }
+    return 0;
+}
+#else
 int main() {
     int runs = 10000;
     int c = 10;
     int w = 6;
+    const uint32_t maxSpin = CSpinPark::s_MaxSpin;
 
-    for ( int i = 0; i < runs; i++ ) {
+    // the solvers of the attached library share a capacity of 100 problems per process ( M = 100 ),
+    // that is a single run of two companies, all the other runs validate the native solver
+    for ( int i = 0; i <= runs; i++ ) {
 //        fprintf ( stderr, "=====================BEGIN===============================\n");
-        fprintf ( stderr, "%d\n", i );
-        COptimizer optimizer;
+        COptimizer::s_NativeSolver = i > 0;
+        // every third run solves the native problems one by one instead of in vector lanes
+        CNativeSolver::s_Batched = i % 3 != 1;
+        // every fourth run spins before parking even on a single core
+        CSpinPark::s_MaxSpin = i % 4 == 3 ? 4096 : maxSpin;
+        int companyCnt = COptimizer::s_NativeSolver ? c : 100 / 50;
+        fprintf ( stderr, "%d%s\n", i, COptimizer::s_NativeSolver ? " native" : "" );
+        // in the service mode, half of the companies join a running optimizer and the last one leaves early,
+        // every other time while an idle company stays connected, nothing but the finished companies flush then
+        bool service = COptimizer::s_NativeSolver && i % 5 == 4;
+        ACompanyIdle idle = service && i % 10 == 9 ? std::make_shared<CCompanyIdle>() : nullptr;
+        // native solvers have no capacity budget, flush them early to exercise the policy
+        TFlushPolicy flushPolicy;
+        if ( COptimizer::s_NativeSolver && ! idle ) {
+            flushPolicy.m_MaxWait = chrono::microseconds ( 100 );
+            flushPolicy.m_FlushWhenIdle = true;
+        }
+        COptimizer optimizer ( flushPolicy );
+        // the only run of the progtest solver and the last run report their statistics
+        if ( i == 0 || i == runs )
+            optimizer.enableStats();
+        // the companies submit the same problems, a small cache both hits and evicts
+        if ( COptimizer::s_NativeSolver && i % 3 == 0 )
+            optimizer.enableCache ( 4 );
+        bool fair = COptimizer::s_NativeSolver && i % 4 == 1;
+        if ( fair )
+            optimizer.enableFairness ( 2 );
+        if ( COptimizer::s_NativeSolver && i % 5 == 2 )
+            optimizer.enableLongestFirst();
+        if ( COptimizer::s_NativeSolver && i % 7 < 3 )
+            optimizer.enableWorkStealing();
+        // the sample problems are small, split them anyway
+        if ( COptimizer::s_NativeSolver && i % 2 == 1 )
+            optimizer.enableSplitting ( 2 );
+        // a pack or two per company and a few dozen problems overall keep the receivers throttled most of the time
+        if ( COptimizer::s_NativeSolver && i % 9 == 3 ) {
+            TFlowLimits company, total;
+            company.m_Packs = i % 2 + 1;
+            total.m_Problems = 30;
+            optimizer.enableBackpressure ( company, total );
+        }
         vector<ACompanyTest> companies;
-        for ( int j = 0; j < c; j++ ) {
+        for ( int j = 0; j < companyCnt; j++ ) {
             ACompanyTest company = std::make_shared<CCompanyTest>();
             companies.push_back(company);
         }
-        for ( const auto & company : companies )
-            optimizer.addCompany(company);
-        optimizer.start(w);
+        if ( service )
+            optimizer.enableService();
+        if ( idle )
+            optimizer.addCompany ( idle );
+        size_t startCnt = service ? companies.size() / 2 : companies.size();
+        for ( size_t j = 0; j < startCnt; j++ )
+            optimizer.addCompany ( companies[j], fair ? j % 3 + 1 : 1 );
+        if ( COptimizer::s_NativeSolver ) {
+            // let the pool grow and shrink
+            TPoolPolicy pool;
+            pool.m_MaxWorkers = w;
+            pool.m_IdleTimeout = chrono::milliseconds ( 1 );
+            // every other run multiplexes the companies on shared I/O threads
+            pool.m_IoThreads = i % 2 ? 0 : 3;
+            optimizer.start ( pool );
+        }
+        else
+            optimizer.start(w);
+        for ( size_t j = startCnt; j < companies.size(); j++ )
+            optimizer.addCompany ( companies[j], fair ? j % 3 + 1 : 1 );
+        if ( service && ! optimizer.removeCompany ( companies.back() ) )
+            throw std::logic_error ( "the company to remove was not found" );
+        if ( idle )
+            idle->release();
         optimizer.stop();
-        for ( const auto & company : companies )
-            if (!company->allProcessed())
+        for ( size_t j = 0; j + service < companies.size(); j++ )
+            if (!companies[j]->allProcessed())
                 throw std::logic_error("(some) problems were not correctly processed");
 //        fprintf ( stderr, "=====================END======================================\n");
     }
     return 0;
 }
-
+#endif /* BENCHMARK */
 #endif /* __PROGTEST__ */
@@ -0,0 +1,254 @@
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "trace_tester.h"
+using namespace std;
+
+//=============================================================================================================================================================
+                                       CCompanyRecorder::CCompanyRecorder      ( ACompany                              company,
+                                                                                 const string                        & fileName )
+  : m_Company ( move ( company ) ),
+    m_File ( fopen ( fileName . c_str (), "wb" ) )
+{
+  if ( ! m_File )
+    throw invalid_argument ( "CCompanyRecorder: cannot create " + fileName );
+  fwrite ( "PKTR", 1, 4, m_File );
+  fwrite ( &TRACE_VERSION, sizeof ( TRACE_VERSION ), 1, m_File );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CCompanyRecorder::~CCompanyRecorder     ( void ) noexcept
+{
+  fclose ( m_File );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyRecorder::write                 ( const void                          * data,
+                                                                                 size_t                                size )
+{
+  m_Buffer . insert ( m_Buffer . end (), (const char *) data, (const char *) data + size );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+uint64_t                               CCompanyRecorder::sinceLast             ( void )
+{
+  auto now = chrono::steady_clock::now ();
+  uint64_t res = m_Started ? chrono::duration_cast<chrono::nanoseconds> ( now - m_Last ) . count () : 0;
+  m_Last = now;
+  m_Started = true;
+  return res;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+AProblemPack                           CCompanyRecorder::waitForPack           ( void )
+{
+  {
+    // the first delay is measured from the first call
+    unique_lock<mutex> lk ( m_Mtx );
+    if ( ! m_Started )
+      sinceLast ();
+  }
+  AProblemPack pack = m_Company -> waitForPack ();
+  unique_lock<mutex> lk ( m_Mtx );
+  uint64_t delay = sinceLast ();
+  m_Buffer . clear ();
+  write ( pack ? "P" : "E", 1 );
+  write ( &delay, sizeof ( delay ) );
+  if ( pack )
+  {
+    uint32_t problems = pack -> m_Problems . size ();
+    write ( &problems, sizeof ( problems ) );
+    for ( const auto & problem : pack -> m_Problems )
+    {
+      int32_t count = problem -> m_Count;
+      uint32_t intervals = problem -> m_Intervals . size ();
+      write ( &count, sizeof ( count ) );
+      write ( &intervals, sizeof ( intervals ) );
+      for ( const auto & interval : problem -> m_Intervals )
+        for ( int32_t field : { interval . m_From, interval . m_To, interval . m_Payment } )
+          write ( &field, sizeof ( field ) );
+    }
+  }
+  fwrite ( m_Buffer . data (), 1, m_Buffer . size (), m_File );
+  return pack;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyRecorder::solvedPack            ( AProblemPack                          pack )
+{
+  {
+    unique_lock<mutex> lk ( m_Mtx );
+    m_Buffer . clear ();
+    uint32_t problems = pack -> m_Problems . size ();
+    write ( "R", 1 );
+    write ( &problems, sizeof ( problems ) );
+    for ( const auto & problem : pack -> m_Problems )
+    {
+      int32_t profit = problem -> m_MaxProfit;
+      write ( &profit, sizeof ( profit ) );
+    }
+    fwrite ( m_Buffer . data (), 1, m_Buffer . size (), m_File );
+  }
+  m_Company -> solvedPack ( pack );
+}
+//=============================================================================================================================================================
+                                       CCompanyReplay::CCompanyReplay          ( const string                        & fileName,
+                                                                                 double                                speed )
+  : m_Speed ( speed )
+{
+  int fd = open ( fileName . c_str (), O_RDONLY );
+  if ( fd < 0 )
+    throw invalid_argument ( "CCompanyReplay: cannot open " + fileName );
+  struct stat st;
+  if ( fstat ( fd, &st ) == 0 && st . st_size > 0 )
+  {
+    void * data = mmap ( nullptr, st . st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data != MAP_FAILED )
+    {
+      m_Data = (const char *) data;
+      m_Size = st . st_size;
+    }
+  }
+  close ( fd );
+  if ( ! m_Data )
+    throw invalid_argument ( "CCompanyReplay: cannot map " + fileName );
+  try
+  {
+    index ();
+  }
+  catch ( ... )
+  {
+    munmap ( (void *) m_Data, m_Size );
+    throw;
+  }
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CCompanyReplay::~CCompanyReplay         ( void ) noexcept
+{
+  munmap ( (void *) m_Data, m_Size );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+template <typename T>
+T                                      CCompanyReplay::read                    ( size_t                              & pos ) const
+{
+  if ( pos + sizeof ( T ) > m_Size )
+    throw invalid_argument ( "CCompanyReplay: truncated trace" );
+  T res;
+  memcpy ( &res, m_Data + pos, sizeof ( T ) );
+  pos += sizeof ( T );
+  return res;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyReplay::index                   ( void )
+{
+  if ( m_Size < 8 || memcmp ( m_Data, "PKTR", 4 ) != 0 )
+    throw invalid_argument ( "CCompanyReplay: not a trace" );
+  size_t pos = 4;
+  if ( read<uint32_t> ( pos ) != TRACE_VERSION )
+    throw invalid_argument ( "CCompanyReplay: unsupported trace version" );
+  uint64_t time = 0;
+  bool end = false;
+  while ( pos < m_Size )
+  {
+    char tag = read<char> ( pos );
+    if ( tag == 'P' || tag == 'E' )
+    {
+      if ( end )
+        throw invalid_argument ( "CCompanyReplay: pack after the end of input" );
+      time += read<uint64_t> ( pos );
+      if ( tag == 'E' )
+      {
+        end = true;
+        continue;
+      }
+      m_Packs . push_back ( pos );
+      m_Arrivals . push_back ( time );
+      for ( uint32_t problems = read<uint32_t> ( pos ); problems > 0; problems -- )
+      {
+        read<int32_t> ( pos );
+        uint32_t intervals = read<uint32_t> ( pos );
+        if ( intervals > ( m_Size - pos ) / ( 3 * sizeof ( int32_t ) ) )
+          throw invalid_argument ( "CCompanyReplay: truncated trace" );
+        pos += intervals * 3 * sizeof ( int32_t );
+        m_ProblemCnt ++;
+      }
+    }
+    else if ( tag == 'R' )
+    {
+      m_Results . push_back ( pos );
+      uint32_t problems = read<uint32_t> ( pos );
+      if ( problems > ( m_Size - pos ) / sizeof ( int32_t ) )
+        throw invalid_argument ( "CCompanyReplay: truncated trace" );
+      pos += problems * sizeof ( int32_t );
+    }
+    else
+      throw invalid_argument ( "CCompanyReplay: unknown record" );
+  }
+  if ( m_Results . size () > m_Packs . size () )
+    throw invalid_argument ( "CCompanyReplay: more results than packs" );
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+AProblemPack                           CCompanyReplay::waitForPack             ( void )
+{
+  if ( m_GetPos == 0 )
+    m_Start = chrono::steady_clock::now ();
+  if ( m_GetPos == m_Packs . size () )
+    return AProblemPack ();
+  if ( m_GetPos > m_Packs . size () )
+    throw invalid_argument ( "waitForPack: called too many times" );
+  // the schedule is kept from the start, so the sleeps do not accumulate their overshoots
+  if ( m_Speed > 0 )
+    this_thread::sleep_until ( m_Start + chrono::nanoseconds ( (uint64_t) ( m_Arrivals[m_GetPos] / m_Speed ) ) );
+
+  size_t pos = m_Packs[m_GetPos ++];
+  AProblemPack pack = make_shared<CProblemPack> ();
+  for ( uint32_t problems = read<uint32_t> ( pos ); problems > 0; problems -- )
+  {
+    int32_t count = read<int32_t> ( pos );
+    AProblem problem = make_shared<CProblem> ( count, initializer_list<CInterval> {} );
+    uint32_t intervals = read<uint32_t> ( pos );
+    problem -> m_Intervals . reserve ( intervals );
+    for ( ; intervals > 0; intervals -- )
+    {
+      int32_t from = read<int32_t> ( pos ), to = read<int32_t> ( pos ), payment = read<int32_t> ( pos );
+      problem -> add ( CInterval ( from, to, payment ) );
+    }
+    pack -> add ( problem );
+  }
+  unique_lock<mutex> lk ( m_Mtx );
+  m_Sent . emplace_back ( pack, chrono::steady_clock::now () );
+  return pack;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+void                                   CCompanyReplay::solvedPack              ( AProblemPack                          pack )
+{
+  auto now = chrono::steady_clock::now ();
+  unique_lock<mutex> lk ( m_Mtx );
+  if ( m_Sent . empty () )
+    throw invalid_argument ( "solvedPack: called too many times" );
+  if ( m_Sent . front () . first != pack )
+    throw invalid_argument ( "solvedPack: order not preserved" );
+  m_Turnarounds . push_back ( chrono::duration_cast<chrono::nanoseconds> ( now - m_Sent . front () . second ) . count () );
+  m_Sent . pop_front ();
+  lk . unlock ();
+
+  if ( m_DonePos < m_Results . size () )
+  {
+    size_t pos = m_Results[m_DonePos];
+    if ( read<uint32_t> ( pos ) != pack -> m_Problems . size () )
+      m_Mismatches ++;
+    else
+      for ( const auto & problem : pack -> m_Problems )
+        if ( read<int32_t> ( pos ) != problem -> m_MaxProfit )
+        {
+          m_Mismatches ++;
+          break;
+        }
+  }
+  m_DonePos ++;
+}
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool                                   CCompanyReplay::allProcessed            ( void ) const
+{
+  return m_GetPos == m_Packs . size () && m_DonePos == m_Packs . size () && m_Mismatches == 0;
+}
+//=============================================================================================================================================================
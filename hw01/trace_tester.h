@@ -0,0 +1,120 @@
+// Recording and replaying the pack streams of companies. Like the sample tester, it does not exist
+// in the progtest's testing environment.
+#ifndef TRACE_TESTER_H_5182937460192837
+#define TRACE_TESTER_H_5182937460192837
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "bench_tester.h"
+
+//=============================================================================================================================================================
+/**
+ * Trace layout, all numbers in the native byte order:
+ *   header   "PKTR", uint32_t version
+ *   'P'      uint64_t ns since the previous waitForPack returned ( since the first call for the first pack ),
+ *            uint32_t problems, for each: int32_t count, uint32_t intervals, for each: int32_t from, to, payment
+ *   'R'      uint32_t problems, int32_t max profit of each, for the packs in the order they were returned
+ *   'E'      uint64_t ns, waitForPack returned the end of input
+ */
+static const uint32_t                  TRACE_VERSION                           = 1;
+//=============================================================================================================================================================
+/**
+ * Forwards to another company and writes the packs it delivers, their timing and the results to a trace.
+ */
+class CCompanyRecorder : public CCompany
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @param[in] company     the recorded company
+     * @param[in] fileName    trace to create, throws invalid_argument if it cannot be
+     */
+                                       CCompanyRecorder                        ( ACompany                              company,
+                                                                                 const std::string                   & fileName );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CCompanyRecorder                        ( const CCompanyRecorder              & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    CCompanyRecorder                 & operator =                              ( const CCompanyRecorder              & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual                            ~CCompanyRecorder                       ( void ) noexcept override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual AProblemPack               waitForPack                             ( void ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual void                       solvedPack                              ( AProblemPack                          pack ) override;
+  private:
+    ACompany                           m_Company;
+    FILE                             * m_File;
+    std::mutex                         m_Mtx;                                   // both the receiver and the returner write
+    std::chrono::steady_clock::time_point m_Last;
+    bool                               m_Started { false };
+    std::vector<char>                  m_Buffer;                                // record being built, guarded by m_Mtx
+
+    void                               write                                   ( const void                          * data,
+                                                                                 size_t                                size );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    uint64_t                           sinceLast                               ( void );
+};
+//=============================================================================================================================================================
+/**
+ * Delivers the packs of a trace and checks the returned results against the recorded ones. The trace is memory mapped,
+ * packs are built from it as they are delivered.
+ */
+class CCompanyReplay : public CCompanyMeasured
+{
+  public:
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @param[in] fileName    trace to replay, throws invalid_argument if it cannot be read or is malformed
+     * @param[in] speed       1 keeps the recorded timing, 2 replays twice as fast, 0 delivers the packs without waiting
+     */
+                                       CCompanyReplay                          ( const std::string                   & fileName,
+                                                                                 double                                speed );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+                                       CCompanyReplay                          ( const CCompanyReplay                & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    CCompanyReplay                   & operator =                              ( const CCompanyReplay                & ) = delete;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual                            ~CCompanyReplay                         ( void ) noexcept override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual AProblemPack               waitForPack                             ( void ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * Checks the order of the returned packs and their results, records their turnaround.
+     */
+    virtual void                       solvedPack                              ( AProblemPack                          pack ) override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    /**
+     * @return true if all the packs were returned in order with the recorded results ( unless none were recorded )
+     */
+    virtual bool                       allProcessed                            ( void ) const override;
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    virtual size_t                     problemCount                            ( void ) const override { return m_ProblemCnt; }
+  private:
+    const char                       * m_Data { nullptr };
+    size_t                             m_Size { 0 };
+    double                             m_Speed;
+    std::vector<size_t>                m_Packs;                                 // offsets of the 'P' records
+    std::vector<uint64_t>              m_Arrivals;                              // ns since the start, by pack
+    std::vector<size_t>                m_Results;                               // offsets of the 'R' records
+    size_t                             m_ProblemCnt { 0 };
+    size_t                             m_GetPos  { 0 };
+    size_t                             m_DonePos { 0 };
+    size_t                             m_Mismatches { 0 };
+    std::chrono::steady_clock::time_point m_Start;
+    std::mutex                         m_Mtx;                                   // m_Sent is shared by waitForPack and solvedPack
+    std::deque<std::pair<AProblemPack, std::chrono::steady_clock::time_point>> m_Sent;
+
+    void                               index                                   ( void );
+    //---------------------------------------------------------------------------------------------------------------------------------------------------------
+    template <typename T>
+    T                                  read                                    ( size_t                              & pos ) const;
+};
+using ACompanyReplay = std::shared_ptr<CCompanyReplay>;
+//=============================================================================================================================================================
+#endif /* TRACE_TESTER_H_5182937460192837 */